@@ -0,0 +1,439 @@
+/*
+ * End-to-end benchmark of qm. Each workload is generated with gen into the
+ * work directory and rendered a number of times by qm, after one run which
+ * warms up the page cache. The report has the throughput in MB/s of input
+ * and in math blocks per second, the variance of the wall time and the peak
+ * RSS of qm. The results are also written as JSON, named after the commit
+ * by build.sh, so that runs can be compared across commits.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <qm/types.h>
+
+#define BENCH_MAX_ARGS 32
+#define BENCH_MAX_RUNS 100
+
+struct bench_workload {
+	const char *name;
+	/* NOTE: the arguments of gen, separated by spaces. */
+	const char *macros;
+	const char *document;
+	u32 blocks;
+	/* NOTE: the options of qm, separated by spaces. */
+	const char *flags;
+};
+
+static const struct bench_workload bench_workloads[] = {
+	{ "baseline", "-n 200 -d 3",     "-n 200 -d 3 -p 20",        20000, "" },
+	{ "prose",    "-n 200 -d 3",     "-n 200 -d 2 -p 400",        2000, "" },
+	{ "deep",     "-n 4000 -d 12",   "-n 4000 -d 4 -p 5",        10000, "" },
+	{ "matrix",   "-n 200 -d 3",     "-n 200 -d 2 -p 5 -w 12",   10000, "" },
+	{ "chain",    "-n 200 -d 3",     "-n 200 -d 2 -p 5 -c 200",  10000, "" },
+	{ "library",  "-n 60000 -d 6",   "-n 60000 -d 3 -p 5",         100, "" },
+	{ "memo",     "-n 200 -d 3",     "-n 200 -d 3 -p 20",        20000, "--memo" },
+	{ "parallel", "-n 200 -d 3",     "-n 200 -d 3 -p 20",        20000, "-j 4" },
+};
+
+struct bench_result {
+	const struct bench_workload *workload;
+	u64 bytes;
+	u32 run_count;
+	f64 times[BENCH_MAX_RUNS];
+	f64 mean;
+	f64 stddev;
+	f64 min;
+	f64 max;
+	/* NOTE: in kilobytes, as reported by getrusage. */
+	u64 peak_rss;
+};
+
+struct bench_options {
+	const char *qm_path;
+	const char *gen_path;
+	const char *work_path;
+	const char *output_path;
+	const char *label;
+	u32 runs;
+	char **names;
+	u32 name_count;
+};
+
+/* Splits the arguments at spaces into argv, which is null-terminated. */
+static u32
+bench_split(char *buffer, usize size, const char *args, char **argv, u32 argc)
+{
+	snprintf(buffer, size, "%s", args);
+	for (char *arg = strtok(buffer, " "); arg; arg = strtok(0, " ")) {
+		if (argc + 1 < BENCH_MAX_ARGS) {
+			argv[argc++] = arg;
+		}
+	}
+
+	argv[argc] = 0;
+	return argc;
+}
+
+/*
+ * Runs the program with its output written to the file. Returns the wall
+ * time in seconds, or a negative number if it failed.
+ */
+static f64
+bench_exec(char **argv, const char *output, struct rusage *usage)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	} else if (pid == 0) {
+		int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (out < 0) {
+			perror(output);
+			_exit(127);
+		}
+
+		dup2(out, STDOUT_FILENO);
+		close(out);
+		execv(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+
+	int status;
+	while (wait4(pid, &status, 0, usage) < 0) {
+		if (errno != EINTR) {
+			perror("wait4");
+			return -1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed with status %d\n", argv[0], status);
+		return -1;
+	}
+
+	return (f64)(end.tv_sec - start.tv_sec) +
+		(f64)(end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+static bool
+bench_generate(struct bench_options *options,
+		const struct bench_workload *workload, char *macro_path,
+		char *document_path, usize path_size)
+{
+	char buffer[256];
+	char blocks[16];
+	char *argv[BENCH_MAX_ARGS];
+	struct rusage usage;
+
+	snprintf(macro_path, path_size, "%s/%s.qm", options->work_path,
+		workload->name);
+	snprintf(document_path, path_size, "%s/%s.json", options->work_path,
+		workload->name);
+
+	argv[0] = (char *)options->gen_path;
+	argv[1] = "macros";
+	bench_split(buffer, sizeof(buffer), workload->macros, argv, 2);
+	if (bench_exec(argv, macro_path, &usage) < 0) {
+		return false;
+	}
+
+	argv[1] = "document";
+	u32 argc = bench_split(buffer, sizeof(buffer), workload->document, argv,
+		2);
+	snprintf(blocks, sizeof(blocks), "%u", workload->blocks);
+	argv[argc++] = "-m";
+	argv[argc++] = blocks;
+	argv[argc] = 0;
+	return bench_exec(argv, document_path, &usage) >= 0;
+}
+
+static bool
+bench_run(struct bench_options *options,
+		const struct bench_workload *workload, struct bench_result *result)
+{
+	char macro_path[4096];
+	char document_path[4096];
+	if (!bench_generate(options, workload, macro_path, document_path,
+			sizeof(macro_path))) {
+		return false;
+	}
+
+	struct stat st;
+	if (stat(document_path, &st) != 0) {
+		perror(document_path);
+		return false;
+	}
+
+	char buffer[256];
+	char *argv[BENCH_MAX_ARGS];
+	argv[0] = (char *)options->qm_path;
+	u32 argc = bench_split(buffer, sizeof(buffer), workload->flags, argv, 1);
+	argv[argc++] = "-i";
+	argv[argc++] = document_path;
+	argv[argc++] = macro_path;
+	argv[argc] = 0;
+
+	memset(result, 0, sizeof(*result));
+	result->workload = workload;
+	result->bytes = st.st_size;
+	result->run_count = options->runs;
+
+	/* NOTE: the first run is not measured, it only warms up the caches. */
+	for (u32 i = 0; i <= options->runs; i++) {
+		struct rusage usage;
+		f64 time = bench_exec(argv, "/dev/null", &usage);
+		if (time < 0) {
+			return false;
+		}
+
+		if (i > 0) {
+			result->times[i - 1] = time;
+			result->peak_rss = MAX(result->peak_rss, (u64)usage.ru_maxrss);
+		}
+	}
+
+	f64 sum = 0;
+	result->min = result->max = result->times[0];
+	for (u32 i = 0; i < result->run_count; i++) {
+		sum += result->times[i];
+		result->min = MIN(result->min, result->times[i]);
+		result->max = MAX(result->max, result->times[i]);
+	}
+
+	result->mean = sum / result->run_count;
+
+	f64 variance = 0;
+	for (u32 i = 0; i < result->run_count; i++) {
+		f64 delta = result->times[i] - result->mean;
+		variance += delta * delta;
+	}
+
+	if (result->run_count > 1) {
+		variance /= result->run_count - 1;
+	}
+
+	result->stddev = sqrt(variance);
+	return true;
+}
+
+static void
+bench_print(FILE *f, struct bench_result *result)
+{
+	const struct bench_workload *workload = result->workload;
+	fprintf(f, "%-10s %9.2f %12.0f %10.2f %9.2f%% %9.1f\n", workload->name,
+		result->bytes / result->mean * 1e-6, workload->blocks / result->mean,
+		result->mean * 1e3, 100 * result->stddev / result->mean,
+		result->peak_rss / 1024.0);
+}
+
+/* NOTE: the strings of the results don't need to be escaped. */
+static bool
+bench_write(struct bench_options *options, struct bench_result *results,
+		u32 result_count)
+{
+	FILE *f = fopen(options->output_path, "w");
+	if (!f) {
+		fprintf(stderr, "Failed to write file '%s': %s\n",
+			options->output_path, strerror(errno));
+		return false;
+	}
+
+	fprintf(f, "{\n  \"label\": \"%s\",\n  \"runs\": %u,\n"
+		"  \"workloads\": [", options->label, options->runs);
+	for (u32 i = 0; i < result_count; i++) {
+		struct bench_result *result = &results[i];
+		const struct bench_workload *workload = result->workload;
+		fprintf(f, "%s\n    {\n", i > 0 ? "," : "");
+		fprintf(f, "      \"name\": \"%s\",\n", workload->name);
+		fprintf(f, "      \"macros\": \"%s\",\n", workload->macros);
+		fprintf(f, "      \"document\": \"%s -m %u\",\n", workload->document,
+			workload->blocks);
+		fprintf(f, "      \"flags\": \"%s\",\n", workload->flags);
+		fprintf(f, "      \"bytes\": %llu,\n",
+			(unsigned long long)result->bytes);
+		fprintf(f, "      \"blocks\": %u,\n", workload->blocks);
+		fprintf(f, "      \"mean\": %.6f,\n", result->mean);
+		fprintf(f, "      \"stddev\": %.6f,\n", result->stddev);
+		fprintf(f, "      \"min\": %.6f,\n", result->min);
+		fprintf(f, "      \"max\": %.6f,\n", result->max);
+		fprintf(f, "      \"mb_per_second\": %.3f,\n",
+			result->bytes / result->mean * 1e-6);
+		fprintf(f, "      \"blocks_per_second\": %.1f,\n",
+			workload->blocks / result->mean);
+		fprintf(f, "      \"peak_rss_kb\": %llu,\n",
+			(unsigned long long)result->peak_rss);
+		fprintf(f, "      \"times\": [");
+		for (u32 j = 0; j < result->run_count; j++) {
+			fprintf(f, "%s%.6f", j > 0 ? ", " : "", result->times[j]);
+		}
+
+		fprintf(f, "]\n    }");
+	}
+
+	fprintf(f, "\n  ]\n}\n");
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Failed to write file '%s': %s\n",
+			options->output_path, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+bench_selected(struct bench_options *options, const char *name)
+{
+	if (options->name_count == 0) {
+		return true;
+	}
+
+	for (u32 i = 0; i < options->name_count; i++) {
+		if (strcmp(options->names[i], name) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+bench_parse(struct bench_options *options, int argc, char **argv)
+{
+	for (i32 i = 1; i < argc; i++) {
+		char *arg = argv[i];
+		const char **value = 0;
+
+		if (strcmp(arg, "-q") == 0) {
+			value = &options->qm_path;
+		} else if (strcmp(arg, "-g") == 0) {
+			value = &options->gen_path;
+		} else if (strcmp(arg, "-d") == 0) {
+			value = &options->work_path;
+		} else if (strcmp(arg, "-o") == 0) {
+			value = &options->output_path;
+		} else if (strcmp(arg, "-l") == 0) {
+			value = &options->label;
+		} else if (strcmp(arg, "-r") == 0) {
+			if (++i == argc || (options->runs = atoi(argv[i])) == 0 ||
+					options->runs > BENCH_MAX_RUNS) {
+				fprintf(stderr, "Expected a number of runs up to %d for -r\n",
+					BENCH_MAX_RUNS);
+				return false;
+			}
+		} else if (arg[0] == '-') {
+			fprintf(stderr, "Unknown option: %s\n", arg);
+			return false;
+		} else {
+			options->names[options->name_count++] = arg;
+		}
+
+		if (value) {
+			if (++i == argc) {
+				fprintf(stderr, "Missing argument for %s\n", arg);
+				return false;
+			}
+
+			*value = argv[i];
+		}
+	}
+
+	return true;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_options options = {0};
+	options.qm_path = "build/qm";
+	options.gen_path = "build/gen";
+	options.work_path = "build/workloads";
+	options.output_path = "build/bench.json";
+	options.label = "";
+	options.runs = 5;
+	options.names = calloc(argc, sizeof(*options.names));
+	if (!options.names) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!bench_parse(&options, argc, argv)) {
+		fprintf(stderr, "usage: %s [-q qm] [-g gen] [-d workdir] [-r runs] "
+			"[-o results.json] [-l label] [workload...]\n", argv[0]);
+		free(options.names);
+		return 1;
+	}
+
+	u32 workload_count = sizeof(bench_workloads) / sizeof(*bench_workloads);
+	for (u32 i = 0; i < options.name_count; i++) {
+		u32 j = 0;
+		while (j < workload_count &&
+				strcmp(bench_workloads[j].name, options.names[i]) != 0) {
+			j++;
+		}
+
+		if (j == workload_count) {
+			fprintf(stderr, "Unknown workload: %s\n", options.names[i]);
+			free(options.names);
+			return 1;
+		}
+	}
+
+	if (mkdir(options.work_path, 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Failed to create directory '%s': %s\n",
+			options.work_path, strerror(errno));
+		free(options.names);
+		return 1;
+	}
+
+	struct bench_result *results = calloc(workload_count, sizeof(*results));
+	if (!results) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%-10s %9s %12s %10s %10s %9s\n", "workload", "MB/s", "blocks/s",
+		"mean ms", "stddev", "RSS MB");
+
+	bool result = true;
+	u32 result_count = 0;
+	for (u32 i = 0; i < workload_count; i++) {
+		const struct bench_workload *workload = &bench_workloads[i];
+		if (!bench_selected(&options, workload->name)) {
+			continue;
+		}
+
+		if (!bench_run(&options, workload, &results[result_count])) {
+			fprintf(stderr, "Failed to run workload '%s'\n", workload->name);
+			result = false;
+			continue;
+		}
+
+		bench_print(stdout, &results[result_count++]);
+		fflush(stdout);
+	}
+
+	result &= bench_write(&options, results, result_count);
+	free(results);
+	free(options.names);
+	return !result;
+}
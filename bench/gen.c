@@ -0,0 +1,410 @@
+/*
+ * Generates the synthetic workloads of the benchmark. The macro library has
+ * a number of fn, op, opr and opp definitions. Each function belongs to a
+ * level and calls a function of the level below it, so a call is expanded
+ * through at most depth functions. The document is a pandoc JSON file with
+ * paragraphs of prose, each followed by a math block which uses the
+ * definitions of a library with the same number of definitions.
+ *
+ * The output only depends on the arguments, so that the workloads of two
+ * runs of the benchmark are the same.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <qm/types.h>
+
+enum gen_kind {
+	GEN_FN,
+	GEN_OP,
+	GEN_OPR,
+	GEN_OPP,
+	GEN_KIND_COUNT,
+};
+
+struct gen_options {
+	bool is_document;
+	u32 definitions;
+	u32 depth;
+	u32 blocks;
+	u32 prose;
+	u32 matrix;
+	u32 chain;
+	u64 seed;
+};
+
+static const char *gen_words[] = {
+	"the", "energy", "of", "a", "state", "is", "bounded", "by", "its",
+	"norm", "and", "therefore", "we", "obtain", "that", "every", "operator",
+	"on", "this", "space", "has", "an", "adjoint", "which", "satisfies",
+};
+
+static u64 gen_state;
+
+static u32
+gen_random(u32 n)
+{
+	/* NOTE: xorshift64*, which is good enough for the shape of a workload. */
+	gen_state ^= gen_state >> 12;
+	gen_state ^= gen_state << 25;
+	gen_state ^= gen_state >> 27;
+	return (u32)((gen_state * 0x2545f4914f6cdd1dull) >> 32) % n;
+}
+
+static enum gen_kind
+gen_kind(u32 definition)
+{
+	return definition % GEN_KIND_COUNT;
+}
+
+static u32
+gen_arity(u32 definition)
+{
+	return 1 + (definition / GEN_KIND_COUNT) % 2;
+}
+
+/* Writes the name of an operator, which starts with a symbol of its kind. */
+static void
+gen_symbol(FILE *f, u32 definition)
+{
+	static const char digits[] = "+-*<>&|~!?@#$%";
+	static const char prefix[GEN_KIND_COUNT] = { 0, '+', '^', '~' };
+
+	fputc(prefix[gen_kind(definition)], f);
+	u32 n = definition / GEN_KIND_COUNT;
+	do {
+		fputc(digits[n % (sizeof(digits) - 1)], f);
+		n /= sizeof(digits) - 1;
+	} while (n > 0);
+}
+
+/* Returns a random definition of the kind, or the count if there is none. */
+static u32
+gen_pick(u32 count, enum gen_kind kind)
+{
+	if (count <= (u32)kind) {
+		return count;
+	}
+
+	u32 n = (count - kind + GEN_KIND_COUNT - 1) / GEN_KIND_COUNT;
+	return gen_random(n) * GEN_KIND_COUNT + kind;
+}
+
+static void gen_expression(FILE *f, u32 count, u32 depth, const char *leaf);
+
+static void
+gen_call(FILE *f, u32 function, u32 count, u32 depth, const char *leaf)
+{
+	fprintf(f, "f%u(", function);
+	for (u32 i = 0; i < gen_arity(function); i++) {
+		if (i > 0) {
+			fputs(", ", f);
+		}
+
+		gen_expression(f, count, depth, leaf);
+	}
+
+	fputc(')', f);
+}
+
+/*
+ * Writes an expression which uses the definitions before the count, nested
+ * up to the depth. The leaves are the given identifier or small numbers.
+ */
+static void
+gen_expression(FILE *f, u32 count, u32 depth, const char *leaf)
+{
+	if (depth == 0 || count == 0) {
+		if (gen_random(4) == 0) {
+			fprintf(f, "%u", gen_random(100));
+		} else {
+			fputs(leaf, f);
+		}
+
+		return;
+	}
+
+	u32 definition = gen_pick(count, gen_random(GEN_KIND_COUNT));
+	if (definition == count) {
+		definition = gen_pick(count, GEN_FN);
+	}
+
+	switch (gen_kind(definition)) {
+	case GEN_FN:
+		gen_call(f, definition, count, depth - 1, leaf);
+		break;
+	case GEN_OP:
+	case GEN_OPR:
+		fputc('(', f);
+		gen_expression(f, count, depth - 1, leaf);
+		fputc(' ', f);
+		gen_symbol(f, definition);
+		fputc(' ', f);
+		gen_expression(f, count, depth - 1, leaf);
+		fputc(')', f);
+		break;
+	case GEN_OPP:
+		fputc('(', f);
+		gen_symbol(f, definition);
+		fputc(' ', f);
+		gen_expression(f, count, depth - 1, leaf);
+		fputc(')', f);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Writes the body of a function, which calls a function of the level below.
+ * The level is taken from the index of the function among the functions.
+ */
+static void
+gen_body(FILE *f, u32 function, u32 depth)
+{
+	const char *last = gen_arity(function) == 1 ? "x" : "y";
+	u32 index = function / GEN_KIND_COUNT;
+	u32 level = index % (depth + 1);
+	u32 op = gen_pick(function, GEN_OP);
+	u32 opp = gen_pick(function, GEN_OPP);
+
+	if (opp < function && gen_random(2) == 0) {
+		gen_symbol(f, opp);
+		fputc(' ', f);
+	}
+
+	if (level == 0) {
+		fputs("x", f);
+	} else {
+		u32 count = (index - level + 1 + depth) / (depth + 1);
+		u32 callee = (gen_random(count) * (depth + 1) + level - 1) *
+			GEN_KIND_COUNT;
+		fprintf(f, "f%u(x", callee);
+		if (gen_arity(callee) == 2) {
+			fprintf(f, ", %s", last);
+		}
+
+		fputc(')', f);
+	}
+
+	if (op < function) {
+		fputc(' ', f);
+		gen_symbol(f, op);
+		fprintf(f, " %s", last);
+	}
+}
+
+static void
+gen_macros(FILE *f, struct gen_options *options)
+{
+	fputs("var pi = `\\pi`\n", f);
+	for (u32 i = 0; i < options->definitions; i++) {
+		switch (gen_kind(i)) {
+		case GEN_FN:
+			fprintf(f, "fn f%u(%s) = `\\mathrm{f%u}(` ", i,
+				gen_arity(i) == 1 ? "x" : "x, y", i);
+			gen_body(f, i, options->depth);
+			fputs(" `)`\n", f);
+			break;
+		case GEN_OP:
+			fputs("op a ", f);
+			gen_symbol(f, i);
+			fprintf(f, " b = a `\\oplus_{%u}` b\n", i);
+			break;
+		case GEN_OPR:
+			fputs("opr a ", f);
+			gen_symbol(f, i);
+			fputs(" b = a `^{` b `}`\n", f);
+			break;
+		case GEN_OPP:
+			fputs("opp ", f);
+			gen_symbol(f, i);
+			fprintf(f, " x = `\\neg_{%u}` x\n", i);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* NOTE: the generated math only contains characters without escapes. */
+static void
+gen_math(FILE *f, struct gen_options *options, u32 block)
+{
+	char leaf[32];
+	snprintf(leaf, sizeof(leaf), "x_%u", block);
+	u32 count = options->definitions;
+
+	switch (block % 4) {
+	case 0:
+		gen_expression(f, count, options->depth, leaf);
+		break;
+	case 1:
+		/* NOTE: juxtaposition of identifiers, numbers and calls. */
+		for (u32 i = 0; i < options->chain; i++) {
+			if (i > 0) {
+				fputc(' ', f);
+			}
+
+			if (gen_random(4) == 0) {
+				gen_expression(f, count, 1, leaf);
+			} else if (gen_random(2) == 0) {
+				fprintf(f, "%u", gen_random(1000));
+			} else {
+				fprintf(f, "%c_%u", 'a' + gen_random(26), gen_random(100));
+			}
+		}
+		break;
+	case 2:
+		fputc('[', f);
+		for (u32 i = 0; i < options->matrix; i++) {
+			fputs(i > 0 ? ", (" : "(", f);
+			for (u32 j = 0; j < options->matrix; j++) {
+				if (j > 0) {
+					fputs(", ", f);
+				}
+
+				gen_expression(f, count, 1, leaf);
+			}
+
+			fputc(')', f);
+		}
+
+		fputc(']', f);
+		break;
+	default:
+		fprintf(f, "pi %s", leaf);
+		for (u32 i = 0; i < 3; i++) {
+			fputc(' ', f);
+			gen_expression(f, count, 2, leaf);
+		}
+		break;
+	}
+}
+
+static void
+gen_document(FILE *f, struct gen_options *options)
+{
+	fputs("{\"pandoc-api-version\":[1,22],\"meta\":{},\"blocks\":[", f);
+	for (u32 i = 0; i < options->blocks; i++) {
+		fputs(i > 0 ? ",{\"t\":\"Para\",\"c\":[" : "{\"t\":\"Para\",\"c\":[", f);
+		for (u32 j = 0; j < options->prose; j++) {
+			u32 word = gen_random(sizeof(gen_words) / sizeof(*gen_words));
+			fprintf(f, "{\"t\":\"Str\",\"c\":\"%s\"},{\"t\":\"Space\"},",
+				gen_words[word]);
+		}
+
+		fprintf(f, "{\"t\":\"Math\",\"c\":[{\"t\":\"%s\"},\"",
+			i % 8 == 7 ? "DisplayMath" : "InlineMath");
+		gen_math(f, options, i);
+		fputs("\"]}]}", f);
+	}
+
+	fputs("]}\n", f);
+}
+
+static bool
+gen_parse_number(char **argv, i32 argc, i32 *i, u32 *value)
+{
+	char *end;
+	if (++*i == argc) {
+		fprintf(stderr, "Missing argument for %s\n", argv[*i - 1]);
+		return false;
+	}
+
+	unsigned long n = strtoul(argv[*i], &end, 10);
+	if (end == argv[*i] || *end != '\0' || n > UINT32_MAX) {
+		fprintf(stderr, "Expected a number for %s\n", argv[*i - 1]);
+		return false;
+	}
+
+	*value = (u32)n;
+	return true;
+}
+
+static bool
+gen_parse(struct gen_options *options, int argc, char **argv)
+{
+	if (argc < 2) {
+		return false;
+	} else if (strcmp(argv[1], "document") == 0) {
+		options->is_document = true;
+	} else if (strcmp(argv[1], "macros") != 0) {
+		fprintf(stderr, "Unknown workload: %s\n", argv[1]);
+		return false;
+	}
+
+	for (i32 i = 2; i < argc; i++) {
+		char *arg = argv[i];
+		u32 seed = 0;
+		bool result = true;
+
+		if (strcmp(arg, "-n") == 0) {
+			result = gen_parse_number(argv, argc, &i, &options->definitions);
+		} else if (strcmp(arg, "-d") == 0) {
+			result = gen_parse_number(argv, argc, &i, &options->depth);
+		} else if (strcmp(arg, "-m") == 0) {
+			result = gen_parse_number(argv, argc, &i, &options->blocks);
+		} else if (strcmp(arg, "-p") == 0) {
+			result = gen_parse_number(argv, argc, &i, &options->prose);
+		} else if (strcmp(arg, "-w") == 0) {
+			result = gen_parse_number(argv, argc, &i, &options->matrix);
+		} else if (strcmp(arg, "-c") == 0) {
+			result = gen_parse_number(argv, argc, &i, &options->chain);
+		} else if (strcmp(arg, "-s") == 0) {
+			result = gen_parse_number(argv, argc, &i, &seed);
+			options->seed = seed;
+		} else {
+			fprintf(stderr, "Unknown option: %s\n", arg);
+			return false;
+		}
+
+		if (!result) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct gen_options options = {0};
+	options.definitions = 200;
+	options.depth = 3;
+	options.blocks = 1000;
+	options.prose = 20;
+	options.matrix = 3;
+	options.chain = 8;
+	options.seed = 1;
+
+	if (!gen_parse(&options, argc, argv)) {
+		fprintf(stderr, "usage: %s macros [-n definitions] [-d depth] "
+			"[-s seed]\n"
+			"       %s document [-n definitions] [-d depth] [-m blocks] "
+			"[-p prose words per block] [-w matrix size] "
+			"[-c chain length] [-s seed]\n", argv[0], argv[0]);
+		return 1;
+	}
+
+	/* NOTE: the state of xorshift must not be zero. */
+	gen_state = options.seed * 0x9e3779b97f4a7c15ull + 1;
+	if (options.is_document) {
+		gen_document(stdout, &options);
+	} else {
+		gen_macros(stdout, &options);
+	}
+
+	if (fflush(stdout) != 0) {
+		perror("write");
+		return 1;
+	}
+
+	return 0;
+}
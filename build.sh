@@ -2,7 +2,17 @@
 
 set -e
 
-CFLAGS="-O2 -std=c11 -Wall -pedantic -I."
+CFLAGS="-O2 -std=c11 -Wall -pedantic -pthread -I."
 
 mkdir -p build/
 cc $CFLAGS -o build/qm qm/main.c
+
+# NOTE: ./build.sh bench [options] runs the benchmark, see bench/bench.c.
+if [ "$1" = "bench" ]; then
+	shift
+	cc $CFLAGS -o build/gen bench/gen.c
+	cc $CFLAGS -o build/bench bench/bench.c -lm
+
+	commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+	build/bench -l "$commit" -o "build/bench-$commit.json" "$@"
+fi
@@ -0,0 +1,817 @@
+/*
+ * Definitions and statements are compiled into a compact bytecode for a stack
+ * machine. Each instruction is an opcode followed by its operands:
+ *
+ *   CONSTANT index              push code->constants[index]
+ *   LOCAL slot                  push the value in the slot of the frame
+ *   NAME symbol                 push the value bound to symbol
+ *   MATRIX width height delim   pop width * height cells, push a matrix
+ *   CALL                        pop the argument and the callee, push result
+ *   UNWRAP                      unwrap the 1x1 matrix on top of the stack
+ *   SLIDE count                 drop count values below the top of the stack
+ *   RETURN                      pop the frame and push its result
+ *
+ * The parameters of a function are resolved to slots at compile time. Free
+ * variables are still resolved by name when they are executed, since they
+ * can refer to the parameters of a calling function.
+ *
+ * Functions are compiled a second time with the environment at the time of
+ * their definition. Subexpressions which don't depend on the parameters are
+ * evaluated once, small functions are inlined and constant fragments of
+ * juxtapositions are concatenated. The result depends on the bindings of the
+ * free variables, so every symbol which was looked up is recorded with its
+ * version and the optimized code is ignored once any of them changes.
+ */
+
+#define TEX_MAX_CALL_DEPTH 4096
+#define TEX_STRING_(x) #x
+#define TEX_STRING(x) TEX_STRING_(x)
+#define TEX_FOLD_BUDGET (1 << 16)
+#define TEX_INLINE_MAX_OPS 64
+
+static bool tex_run(struct tex_vm *vm, struct tex_code *code,
+	struct tex_value *value, struct qm_memory_arena *arena,
+	struct tex_environment *env);
+
+static void *
+tex_grow(void *data, u32 *capacity, u32 needed, usize item_size)
+{
+	if (needed > *capacity) {
+		u32 new_capacity = MAX(*capacity, 64);
+		while (new_capacity < needed) {
+			new_capacity *= 2;
+		}
+
+		if (!(data = realloc(data, new_capacity * item_size))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+
+		*capacity = new_capacity;
+	}
+
+	return data;
+}
+
+/*
+ * NOTE: juxtapositions only reference their parts, so that long chains don't
+ * copy the rendered prefix at every step. They are written at output time.
+ */
+static void
+tex_concat(struct tex_value *callee, struct tex_value *arg,
+		struct tex_value *value, struct qm_memory_arena *arena)
+{
+	struct tex_value *parts = arena_alloc(arena, 2, struct tex_value);
+	parts[0] = *callee;
+	parts[1] = *arg;
+
+	value->type = TEX_VALUE_CONCAT;
+	value->concat.left = &parts[0];
+	value->concat.right = &parts[1];
+}
+
+static void
+tex_emit(struct tex_vm *vm, u32 op)
+{
+	vm->ops = tex_grow(vm->ops, &vm->op_capacity, vm->op_count + 1,
+		sizeof(*vm->ops));
+	vm->ops[vm->op_count++] = op;
+}
+
+static void
+tex_push_kind(struct tex_vm *vm, u8 kind)
+{
+	vm->kinds = tex_grow(vm->kinds, &vm->kind_capacity, vm->depth + 1,
+		sizeof(*vm->kinds));
+	vm->kinds[vm->depth++] = kind;
+}
+
+static void
+tex_emit_constant(struct tex_vm *vm, struct tex_value *value)
+{
+	vm->constants = tex_grow(vm->constants, &vm->constant_capacity,
+		vm->constant_count + 1, sizeof(*vm->constants));
+
+	tex_emit(vm, TEX_OP_CONSTANT);
+	tex_emit(vm, vm->constant_count);
+	vm->constants[vm->constant_count++] = *value;
+	vm->constant_end = vm->op_count;
+
+	bool is_function = value->type == TEX_VALUE_FUNCTION;
+	tex_push_kind(vm, is_function ? TEX_KIND_FUNCTION : TEX_KIND_VALUE);
+}
+
+static void
+tex_assume(struct tex_vm *vm, u32 symbol)
+{
+	for (u32 i = 0; i < vm->assumption_count; i++) {
+		if (vm->assumptions[i].symbol == symbol) {
+			return;
+		}
+	}
+
+	vm->assumptions = tex_grow(vm->assumptions, &vm->assumption_capacity,
+		vm->assumption_count + 1, sizeof(*vm->assumptions));
+
+	struct tex_assumption *assumption = &vm->assumptions[vm->assumption_count++];
+	assumption->symbol = symbol;
+	assumption->version = symbol_version(symbol);
+}
+
+static bool
+tex_assumptions_hold(struct tex_code *code)
+{
+	for (u32 i = 0; i < code->assumption_count; i++) {
+		struct tex_assumption *assumption = &code->assumptions[i];
+		if (symbol_version(assumption->symbol) != assumption->version) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Replaces the instructions from start to the end, which push a single value
+ * that doesn't depend on the parameters, with the value itself. Fails if the
+ * evaluation would depend on the dynamic scope or doesn't terminate quickly.
+ */
+static bool
+tex_fold(struct tex_vm *vm, u32 start, struct qm_memory_arena *arena)
+{
+	u32 end = vm->op_count;
+	if (end - start == 2 && vm->ops[start] == TEX_OP_CONSTANT) {
+		return true;
+	}
+
+	tex_emit(vm, TEX_OP_RETURN);
+
+	struct tex_code code = {0};
+	code.ops = vm->ops + start;
+	code.op_count = vm->op_count - start;
+	code.constants = vm->constants;
+	code.constant_count = vm->constant_count;
+
+	/* NOTE: cached results would hide the symbols which were looked up. */
+	struct tex_memo *memo = vm->memo;
+	struct tex_value value;
+	vm->memo = 0;
+	vm->is_folding = true;
+	vm->fold_failed = false;
+	vm->fold_budget = TEX_FOLD_BUDGET;
+	bool is_folded = tex_run(vm, &code, &value, arena, vm->env);
+	vm->is_folding = false;
+	vm->memo = memo;
+
+	vm->op_count = end;
+	if (is_folded) {
+		tex_value_flatten(&value, arena);
+		vm->op_count = start;
+		vm->depth--;
+		if (vm->concat_end > start) {
+			vm->concat_end = 0;
+		}
+
+		tex_emit_constant(vm, &value);
+	}
+
+	return is_folded;
+}
+
+/*
+ * Inlines the body of a function into the code of the caller. The arguments
+ * stay on the stack, where the body accesses them as additional slots of the
+ * frame, and are dropped after the result was computed.
+ */
+static bool
+tex_inline(struct tex_vm *vm, struct tex_code *function,
+		struct qm_expression *arg, u32 callee_start, u32 arg_start)
+{
+	struct tex_code *body = function->optimized;
+	if (!body || !body->is_inlinable || body->op_count > TEX_INLINE_MAX_OPS ||
+			!tex_assumptions_hold(body)) {
+		return false;
+	}
+
+	u32 parameter_count = function->parameter_count;
+	if (parameter_count > 1) {
+		if (vm->constant_end == vm->op_count) {
+			struct tex_value value = vm->constants[vm->ops[vm->op_count - 1]];
+			if (value.type != TEX_VALUE_MATRIX ||
+					value.matrix.width != parameter_count ||
+					value.matrix.height != 1) {
+				return false;
+			}
+
+			vm->op_count -= 2;
+			vm->depth--;
+			for (u32 i = 0; i < parameter_count; i++) {
+				tex_emit_constant(vm, &value.matrix.values[i]);
+			}
+		} else if (arg->type == QM_EXPR_MATRIX &&
+				arg->matrix.width == parameter_count &&
+				arg->matrix.height == 1) {
+			/* NOTE: keep the cells on the stack instead of the matrix. */
+			vm->op_count -= 4;
+			vm->depth += parameter_count - 1;
+		} else {
+			return false;
+		}
+	}
+
+	/*
+	 * NOTE: the callee is removed from the stack, so the slots of inlined
+	 * arguments of functions above it move down.
+	 */
+	u32 callee_slot = vm->local_count + vm->depth - parameter_count - 1;
+	for (u32 ip = arg_start; ip < vm->op_count;) {
+		u32 op = vm->ops[ip];
+		if (op == TEX_OP_LOCAL && vm->ops[ip + 1] > callee_slot) {
+			vm->ops[ip + 1]--;
+		}
+
+		ip += 1 + tex_operand_count[op];
+	}
+
+	memmove(vm->ops + callee_start, vm->ops + arg_start,
+		(vm->op_count - arg_start) * sizeof(*vm->ops));
+	vm->op_count -= arg_start - callee_start;
+	vm->depth--;
+
+	u32 depth = vm->depth - parameter_count;
+	u32 offset = vm->local_count + depth;
+	for (u32 ip = 0; body->ops[ip] != TEX_OP_RETURN;) {
+		u32 op = body->ops[ip];
+		switch (op) {
+		case TEX_OP_CONSTANT:
+			tex_emit_constant(vm, &body->constants[body->ops[ip + 1]]);
+			break;
+		case TEX_OP_LOCAL:
+			tex_emit(vm, op);
+			tex_emit(vm, offset + body->ops[ip + 1]);
+			break;
+		default:
+			for (u32 i = 0; i <= tex_operand_count[op]; i++) {
+				tex_emit(vm, body->ops[ip + i]);
+			}
+		}
+
+		ip += 1 + tex_operand_count[op];
+	}
+
+	tex_emit(vm, TEX_OP_SLIDE);
+	tex_emit(vm, parameter_count);
+	vm->depth = depth;
+	tex_push_kind(vm, TEX_KIND_UNKNOWN);
+	vm->constant_end = 0;
+	vm->concat_end = 0;
+
+	for (u32 i = 0; i < body->assumption_count; i++) {
+		tex_assume(vm, body->assumptions[i].symbol);
+	}
+
+	return true;
+}
+
+static void
+tex_emit_call(struct tex_vm *vm, struct qm_memory_arena *arena)
+{
+	bool is_concat = vm->kinds[vm->depth - 2] == TEX_KIND_VALUE;
+	bool has_constant_arg = vm->constant_end == vm->op_count;
+
+	/*
+	 * NOTE: juxtaposition renders the values, so the constant arguments of
+	 * two consecutive concatenations can be combined into one.
+	 */
+	if (vm->env && is_concat && has_constant_arg &&
+			vm->concat_end + 2 == vm->op_count) {
+		struct tex_value *left = &vm->constants[vm->ops[vm->concat_end - 2]];
+		struct tex_value *right = &vm->constants[vm->ops[vm->op_count - 1]];
+		struct tex_value value;
+		tex_concat(left, right, &value, arena);
+		tex_value_flatten(&value, arena);
+
+		vm->op_count = vm->concat_end - 3;
+		vm->depth -= 2;
+		tex_push_kind(vm, TEX_KIND_VALUE);
+		tex_emit_constant(vm, &value);
+	}
+
+	tex_emit(vm, TEX_OP_CALL);
+	vm->depth -= 2;
+	tex_push_kind(vm, is_concat ? TEX_KIND_VALUE : TEX_KIND_UNKNOWN);
+	if (is_concat && has_constant_arg) {
+		vm->concat_end = vm->op_count;
+	}
+}
+
+static bool tex_compile_child(struct tex_vm *vm,
+	struct qm_expression *expression, u32 *parameters, u32 parameter_count,
+	struct qm_memory_arena *arena);
+
+/* NOTE: returns whether the value doesn't depend on the parameters. */
+static bool
+tex_compile_expression(struct tex_vm *vm, struct qm_expression *expression,
+		u32 *parameters, u32 parameter_count, struct qm_memory_arena *arena)
+{
+	struct tex_value value = {0};
+	bool is_constant = true;
+
+	switch (expression->type) {
+	case QM_EXPR_MATRIX:
+		{
+			struct qm_matrix *matrix = &expression->matrix;
+			u32 count = matrix->width * matrix->height;
+			for (u32 i = 0; i < count; i++) {
+				is_constant &= tex_compile_child(vm, &matrix->expressions[i],
+					parameters, parameter_count, arena);
+			}
+
+			tex_emit(vm, TEX_OP_MATRIX);
+			tex_emit(vm, matrix->width);
+			tex_emit(vm, matrix->height);
+			tex_emit(vm, matrix->delimiter);
+			vm->depth -= count;
+			tex_push_kind(vm, TEX_KIND_VALUE);
+		}
+		break;
+	case QM_EXPR_CALL:
+		{
+			struct qm_call *call = &expression->call;
+			bool is_variable = call->callee->type == QM_EXPR_VARIABLE;
+			if (is_variable && call->callee->variable == QM_SYMBOL_UNWRAP) {
+				is_constant = tex_compile_child(vm, call->arg,
+					parameters, parameter_count, arena);
+				tex_emit(vm, TEX_OP_UNWRAP);
+				vm->kinds[vm->depth - 1] = TEX_KIND_UNKNOWN;
+				break;
+			}
+
+			u32 callee_start = vm->op_count;
+			is_constant &= tex_compile_child(vm, call->callee,
+				parameters, parameter_count, arena);
+			u32 arg_start = vm->op_count;
+			is_constant &= tex_compile_child(vm, call->arg,
+				parameters, parameter_count, arena);
+
+			/*
+			 * NOTE: a function can only be inlined if its callees don't look
+			 * up its parameters by name, since its frame disappears.
+			 */
+			u8 callee_kind = vm->kinds[vm->depth - 2];
+			if (callee_kind == TEX_KIND_FUNCTION) {
+				u32 index = vm->ops[callee_start + 1];
+				struct tex_code *function = vm->constants[index].function.code;
+				if (!is_constant &&
+						tex_inline(vm, function, call->arg, callee_start, arg_start)) {
+					break;
+				}
+
+				if (!tex_is_pure(function, vm->env)) {
+					vm->is_inlinable = false;
+				}
+			} else if (callee_kind == TEX_KIND_UNKNOWN) {
+				vm->is_inlinable = false;
+			}
+
+			tex_emit_call(vm, arena);
+		}
+		break;
+	case QM_EXPR_STRING:
+	case QM_EXPR_RAW_STRING:
+		// NOTE: should use a conversion function in the future for escaping
+		// special symbols.
+		value.type = TEX_VALUE_RAW_STRING;
+		if (expression->type == QM_EXPR_STRING) {
+			value.type = TEX_VALUE_STRING;
+		}
+
+		value.string.data = expression->string.data;
+		value.string.size = expression->string.size;
+		tex_emit_constant(vm, &value);
+		break;
+	case QM_EXPR_VARIABLE:
+		{
+			/* NOTE: later parameters shadow earlier ones with the same name. */
+			u32 name = expression->variable;
+			u32 slot = parameter_count;
+			while (slot-- > 0 && parameters[slot] != name);
+
+			if (slot < parameter_count) {
+				tex_emit(vm, TEX_OP_LOCAL);
+				tex_emit(vm, slot);
+				is_constant = false;
+			} else {
+				tex_emit(vm, TEX_OP_NAME);
+				tex_emit(vm, name);
+				is_constant = name != vm->defining &&
+					!(symbol_flags(name) & QM_SYMBOL_PARAMETER);
+			}
+
+			tex_push_kind(vm, TEX_KIND_UNKNOWN);
+		}
+		break;
+	case QM_EXPR_NUMBER:
+		value.type = TEX_VALUE_NUMBER;
+		value.number = expression->number;
+		tex_emit_constant(vm, &value);
+		break;
+	default:
+		assert(!"Invalid expression");
+	}
+
+	return is_constant;
+}
+
+static bool
+tex_compile_child(struct tex_vm *vm, struct qm_expression *expression,
+		u32 *parameters, u32 parameter_count, struct qm_memory_arena *arena)
+{
+	u32 start = vm->op_count;
+	bool is_constant = tex_compile_expression(vm, expression,
+		parameters, parameter_count, arena);
+
+	if (vm->env && is_constant) {
+		is_constant = tex_fold(vm, start, arena);
+	}
+
+	return is_constant;
+}
+
+static struct tex_code *
+tex_compile_code(struct tex_vm *vm, struct qm_expression *expression,
+		u32 *parameters, u32 parameter_count, struct qm_memory_arena *arena)
+{
+	vm->op_count = 0;
+	vm->constant_count = 0;
+	vm->local_count = parameter_count;
+	vm->depth = 0;
+	vm->constant_end = 0;
+	vm->concat_end = 0;
+	vm->is_inlinable = true;
+	vm->assumption_count = 0;
+
+	tex_compile_child(vm, expression, parameters, parameter_count, arena);
+	tex_emit(vm, TEX_OP_RETURN);
+	assert(vm->depth == 1);
+
+	struct tex_code *code = arena_alloc_zero(arena, 1, struct tex_code);
+	code->parameters = parameters;
+	code->parameter_count = parameter_count;
+	code->op_count = vm->op_count;
+	code->ops = arena_alloc(arena, vm->op_count, u32);
+	memcpy(code->ops, vm->ops, vm->op_count * sizeof(*vm->ops));
+	code->constant_count = vm->constant_count;
+	code->constants = arena_alloc(arena, vm->constant_count, struct tex_value);
+	if (vm->constant_count > 0) {
+		memcpy(code->constants, vm->constants,
+			vm->constant_count * sizeof(*vm->constants));
+	}
+
+	code->assumption_count = vm->assumption_count;
+	code->assumptions = arena_alloc(arena, vm->assumption_count,
+		struct tex_assumption);
+	if (vm->assumption_count > 0) {
+		memcpy(code->assumptions, vm->assumptions,
+			vm->assumption_count * sizeof(*vm->assumptions));
+	}
+	code->is_inlinable = vm->is_inlinable;
+
+	return code;
+}
+
+static struct tex_code *
+tex_compile(struct tex_vm *vm, struct qm_expression *expression,
+		u32 *parameters, u32 parameter_count, struct qm_memory_arena *arena)
+{
+	for (u32 i = 0; i < parameter_count; i++) {
+		symbol_set_flags(parameters[i], QM_SYMBOL_PARAMETER);
+	}
+
+	return tex_compile_code(vm, expression, parameters, parameter_count, arena);
+}
+
+/*
+ * Compiles the body of a function definition again, specialized for the
+ * current bindings of its free variables. Returns null if nothing could be
+ * optimized.
+ */
+static struct tex_code *
+tex_optimize(struct tex_vm *vm, struct tex_code *code,
+		struct qm_definition *definition, struct tex_environment *env,
+		struct qm_memory_arena *arena)
+{
+	vm->env = env;
+	vm->defining = definition->variable;
+	struct tex_code *optimized = tex_compile_code(vm, &definition->expression,
+		definition->parameters, definition->parameter_count, arena);
+	vm->env = 0;
+	vm->defining = 0;
+
+	bool is_unchanged = optimized->op_count == code->op_count &&
+		memcmp(optimized->ops, code->ops, code->op_count * sizeof(*code->ops)) == 0;
+	if (is_unchanged && !optimized->is_inlinable) {
+		optimized = 0;
+	}
+
+	return optimized;
+}
+
+static void
+tex_push(struct tex_vm *vm, struct tex_value *value)
+{
+	vm->stack = tex_grow(vm->stack, &vm->stack_capacity, vm->stack_size + 1,
+		sizeof(*vm->stack));
+	vm->stack[vm->stack_size++] = *value;
+}
+
+static bool
+tex_push_frame(struct tex_vm *vm, struct tex_code *code, u32 base)
+{
+	if (vm->frame_count == TEX_MAX_CALL_DEPTH) {
+		if (vm->is_folding) {
+			vm->fold_failed = true;
+			return false;
+		}
+
+		/* NOTE: tex_run unwinds the frames of the statement. */
+		vm->error = "maximum call depth of " TEX_STRING(TEX_MAX_CALL_DEPTH)
+			" exceeded";
+		return false;
+	}
+
+	vm->frames = tex_grow(vm->frames, &vm->frame_capacity,
+		vm->frame_count + 1, sizeof(*vm->frames));
+
+	struct tex_frame *frame = &vm->frames[vm->frame_count++];
+	frame->code = code;
+	frame->ip = 0;
+	frame->base = base;
+	frame->memo_code = 0;
+	return true;
+}
+
+/*
+ * Looks up a free variable through the parameters of the active functions,
+ * from the innermost call outwards.
+ */
+static bool
+tex_lookup(struct tex_vm *vm, u32 name, struct tex_value *value)
+{
+	for (u32 i = vm->frame_count; i-- > 0;) {
+		struct tex_frame *frame = &vm->frames[i];
+		u32 *parameters = frame->code->parameters;
+
+		for (u32 slot = frame->code->parameter_count; slot-- > 0;) {
+			if (parameters[slot] == name) {
+				*value = vm->stack[frame->base + slot];
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/* NOTE: the code is shared by the threads, so it is only read here. */
+static struct tex_code *
+tex_select_code(struct tex_code *code)
+{
+	struct tex_code *optimized = code->optimized;
+	if (optimized && tex_assumptions_hold(optimized)) {
+		return optimized;
+	}
+
+	return code;
+}
+
+/*
+ * NOTE: returns false if the evaluation of a constant or of the statement
+ * was aborted.
+ */
+static bool
+tex_run(struct tex_vm *vm, struct tex_code *code, struct tex_value *value,
+		struct qm_memory_arena *arena, struct tex_environment *env)
+{
+	u32 frame_base = vm->frame_count;
+	u32 stack_base = vm->stack_size;
+	if (!tex_push_frame(vm, code, vm->stack_size)) {
+		return false;
+	}
+
+	while (vm->frame_count > frame_base) {
+		struct tex_frame *frame = &vm->frames[vm->frame_count - 1];
+		u32 *ops = frame->code->ops;
+		struct tex_value result;
+
+		if (vm->error || (vm->is_folding &&
+				(vm->fold_failed || vm->fold_budget-- == 0))) {
+			vm->frame_count = frame_base;
+			vm->stack_size = stack_base;
+			return false;
+		}
+
+		switch (ops[frame->ip++]) {
+		case TEX_OP_CONSTANT:
+			tex_push(vm, &frame->code->constants[ops[frame->ip++]]);
+			break;
+		case TEX_OP_LOCAL:
+			result = vm->stack[frame->base + ops[frame->ip++]];
+			tex_push(vm, &result);
+			break;
+		case TEX_OP_NAME:
+			{
+				u32 name = ops[frame->ip++];
+				if (!tex_lookup(vm, name, &result)) {
+					if (vm->is_folding) {
+						if (symbol_flags(name) & QM_SYMBOL_PARAMETER) {
+							vm->fold_failed = true;
+						}
+
+						tex_assume(vm, name);
+					}
+
+					if (!tex_env_find(env, name, &result)) {
+						result.type = TEX_VALUE_RAW_STRING;
+						result.string.data = symbol_name(name);
+						result.string.size = symbol_length(name);
+					}
+				}
+
+				tex_push(vm, &result);
+			}
+			break;
+		case TEX_OP_MATRIX:
+			{
+				result.type = TEX_VALUE_MATRIX;
+				result.matrix.width = ops[frame->ip++];
+				result.matrix.height = ops[frame->ip++];
+				result.matrix.delimiter = ops[frame->ip++];
+
+				u32 count = result.matrix.width * result.matrix.height;
+				assert(count <= vm->stack_size);
+				vm->stack_size -= count;
+				result.matrix.values = arena_alloc(arena, count,
+					struct tex_value);
+				memcpy(result.matrix.values, vm->stack + vm->stack_size,
+					count * sizeof(*result.matrix.values));
+				tex_push(vm, &result);
+			}
+			break;
+		case TEX_OP_CALL:
+			{
+				assert(vm->stack_size >= 2);
+				struct tex_value arg = vm->stack[--vm->stack_size];
+				struct tex_value callee = vm->stack[--vm->stack_size];
+
+				if (callee.type == TEX_VALUE_FUNCTION) {
+					struct tex_code *callee_code = callee.function.code;
+					u32 parameter_count = callee_code->parameter_count;
+
+					struct tex_memo *memo = vm->memo;
+					u32 h = 2166136261u ^ (u32)(uintptr_t)callee_code;
+					bool memoize = false;
+					if (memo) {
+						if (memo->version != env->version) {
+							tex_memo_flush(memo, env);
+						}
+
+						memoize = tex_is_memoizable(callee_code, env) &&
+							tex_value_hash(&arg, &h);
+						if (memoize && tex_memo_find(memo, callee_code, &arg, h, &result)) {
+							tex_push(vm, &result);
+							break;
+						}
+					}
+
+					bool is_matrix = arg.type == TEX_VALUE_MATRIX;
+					u32 width = arg.matrix.width;
+					u32 height = arg.matrix.height;
+					bool is_valid = parameter_count == 1 ||
+						(is_matrix && width == parameter_count && height == 1);
+					if (!is_valid && vm->is_folding) {
+						vm->fold_failed = true;
+						break;
+					}
+
+					assert(is_valid);
+
+					/* NOTE: the arguments become the slots of the new frame. */
+					u32 base = vm->stack_size;
+					if (parameter_count == 1) {
+						tex_push(vm, &arg);
+					} else {
+						for (u32 i = 0; i < parameter_count; i++) {
+							tex_push(vm, &arg.matrix.values[i]);
+						}
+					}
+
+					if (!tex_push_frame(vm, tex_select_code(callee_code), base)) {
+						break;
+					}
+
+					frame = &vm->frames[vm->frame_count - 1];
+					frame->memo_code = memoize ? callee_code : 0;
+					frame->hash = h;
+					frame->arg = arg;
+				} else {
+					tex_concat(&callee, &arg, &result, arena);
+					tex_push(vm, &result);
+				}
+			}
+			break;
+		case TEX_OP_UNWRAP:
+			assert(vm->stack_size >= 1);
+			result = *tex_builtin_unwrap(&vm->stack[vm->stack_size - 1]);
+			vm->stack[vm->stack_size - 1] = result;
+			break;
+		case TEX_OP_SLIDE:
+			{
+				u32 count = ops[frame->ip++];
+				assert(vm->stack_size > count);
+				vm->stack[vm->stack_size - count - 1] = vm->stack[vm->stack_size - 1];
+				vm->stack_size -= count;
+			}
+			break;
+		case TEX_OP_RETURN:
+			assert(vm->stack_size == frame->base + frame->code->parameter_count + 1);
+			result = vm->stack[vm->stack_size - 1];
+			vm->stack_size = frame->base;
+			vm->frame_count--;
+
+			if (frame->memo_code) {
+				tex_memo_insert(vm->memo, frame->memo_code, &frame->arg,
+					frame->hash, &result);
+			}
+
+			if (vm->frame_count > frame_base) {
+				tex_push(vm, &result);
+			} else {
+				*value = result;
+			}
+			break;
+		default:
+			assert(!"Invalid opcode");
+		}
+	}
+
+	assert(0 <= value->type && value->type < TEX_VALUE_COUNT);
+	return true;
+}
+
+/*
+ * Returns false if the statement failed at runtime, in which case nothing is
+ * written or defined. The error is not reported here, since only the caller
+ * knows where the statement came from.
+ */
+static bool
+tex_eval(struct tex_vm *vm, struct qm_statement *stmt,
+		struct qm_output *output, struct qm_memory_arena *arena,
+		struct tex_environment *env)
+{
+	struct tex_value value;
+	struct tex_code *code = 0;
+
+	vm->error = 0;
+	switch (stmt->type) {
+	case QM_STMT_EXPRESSION:
+		code = tex_compile(vm, &stmt->expression, 0, 0, arena);
+		if (!tex_run(vm, code, &value, arena, env)) {
+			break;
+		}
+
+		if (output) {
+			tex_value_write(&value, output);
+		}
+		break;
+	case QM_STMT_DEFINITION:
+		code = tex_compile(vm, &stmt->definition.expression,
+			stmt->definition.parameters, stmt->definition.parameter_count,
+			arena);
+
+		if (stmt->definition.parameter_count != 0) {
+			code->optimized = tex_optimize(vm, code, &stmt->definition, env,
+				arena);
+			value.type = TEX_VALUE_FUNCTION;
+			value.function.code = code;
+		} else if (!tex_run(vm, code, &value, arena, env)) {
+			break;
+		}
+
+		tex_env_define(env, arena, stmt->definition.variable, &value);
+		break;
+	}
+
+	return !vm->error;
+}
+
+static void
+tex_vm_finish(struct tex_vm *vm)
+{
+	free(vm->stack);
+	free(vm->frames);
+	free(vm->ops);
+	free(vm->constants);
+	free(vm->kinds);
+	free(vm->assumptions);
+}
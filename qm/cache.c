@@ -0,0 +1,516 @@
+/*
+ * Cache for the rendered math blocks, which is kept on disk between runs.
+ * A block is rendered the same way as long as its source and the state of
+ * the environment before it are the same. The state starts as the hash of
+ * the macro source for each document, and each block which contains a
+ * definition is mixed into it. Those blocks are always evaluated, since
+ * they change the environment for the blocks after them, and blocks with
+ * errors are never cached, so that the errors are reported again.
+ *
+ * The cache is a single file in the directory, with an index of fixed-size
+ * records followed by the rendered blocks. Before the records is the tick
+ * of the run which last used each of them, and the least recently used
+ * entries are dropped once the file would be larger than the limit. The
+ * file is replaced as a whole when new entries are saved, under a lock, and
+ * the entries which were saved by other processes in the meantime are
+ * merged in. A run which only used existing entries writes their ticks in
+ * place, which is why the ticks are not part of the checksum.
+ */
+
+#define QM_RENDER_CACHE_VERSION 2
+#define QM_RENDER_CACHE_SIZE ((u64)64 << 20)
+
+struct qm_render_record {
+	u64 state;
+	u64 hash;
+	u64 offset;
+	u32 size;
+	u32 reserved;
+};
+
+struct qm_render_header {
+	u8 magic[8];
+	u32 version;
+	u32 record_count;
+	u64 tick;
+	u64 data_size;
+	/* NOTE: the hash of the records and the data, after the ticks. */
+	u64 checksum;
+};
+
+struct qm_render_entry {
+	u64 state;
+	u64 hash;
+	const u8 *data;
+	u32 size;
+	u32 tick;
+	/* NOTE: the index of the record in the loaded file, plus one. */
+	u32 record;
+};
+
+struct qm_render_cache {
+	bool is_enabled;
+	/* NOTE: set if there are new entries, or only new ticks. */
+	bool is_dirty;
+	bool is_touched;
+	char path[4096];
+	char lock_path[4096];
+
+	/* NOTE: the entries refer to the mapped file or to the arena. */
+	struct qm_buffer file;
+	struct qm_memory_arena arena;
+	struct qm_render_entry *entries;
+	u32 entry_count;
+	u32 entry_capacity;
+	u32 *slots;
+	u32 slot_count;
+
+	/* NOTE: identifies the loaded file when the ticks are written. */
+	u64 checksum;
+	u32 record_count;
+
+	u64 limit;
+	u32 tick;
+	/* NOTE: the state before the current block, see render_cache_define. */
+	u64 state;
+
+	struct qm_cache_stats stats;
+};
+
+static const u8 render_cache_magic[8] = "qmrender";
+static struct qm_render_cache render_cache;
+
+static u64
+render_cache_combine(u64 a, u64 b)
+{
+	u64 words[2] = { a, b };
+	return image_hash((const u8 *)words, sizeof(words));
+}
+
+static u32
+render_cache_slot(u64 state, u64 hash)
+{
+	u32 mask = render_cache.slot_count - 1;
+	u32 i = (u32)render_cache_combine(state, hash) & mask;
+	while (render_cache.slots[i]) {
+		u32 id = render_cache.slots[i];
+		struct qm_render_entry *entry = &render_cache.entries[id - 1];
+		if (entry->state == state && entry->hash == hash) {
+			break;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	return i;
+}
+
+static struct qm_render_entry *
+render_cache_lookup(u64 state, u64 hash)
+{
+	if (render_cache.slot_count == 0) {
+		return 0;
+	}
+
+	u32 id = render_cache.slots[render_cache_slot(state, hash)];
+	return id ? &render_cache.entries[id - 1] : 0;
+}
+
+/* Adds the entry, or keeps the more recent tick if it already exists. */
+static void
+render_cache_add(u64 state, u64 hash, const u8 *data, u32 size, u32 tick,
+		u32 record)
+{
+	struct qm_render_entry *entry = render_cache_lookup(state, hash);
+	if (entry) {
+		entry->tick = MAX(entry->tick, tick);
+		return;
+	}
+
+	if (2 * (render_cache.entry_count + 1) > render_cache.slot_count) {
+		free(render_cache.slots);
+		render_cache.slot_count = MAX(2 * render_cache.slot_count, 1024);
+		render_cache.slots = calloc(render_cache.slot_count, sizeof(u32));
+		if (!render_cache.slots) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+
+		for (u32 i = 0; i < render_cache.entry_count; i++) {
+			struct qm_render_entry *old = &render_cache.entries[i];
+			render_cache.slots[render_cache_slot(old->state, old->hash)] = i + 1;
+		}
+	}
+
+	if (render_cache.entry_count == render_cache.entry_capacity) {
+		render_cache.entry_capacity = MAX(2 * render_cache.entry_capacity, 1024);
+		render_cache.entries = realloc(render_cache.entries,
+			render_cache.entry_capacity * sizeof(*render_cache.entries));
+		if (!render_cache.entries) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	u32 id = render_cache.entry_count++;
+	entry = &render_cache.entries[id];
+	entry->state = state;
+	entry->hash = hash;
+	entry->data = data;
+	entry->size = size;
+	entry->tick = tick;
+	entry->record = record;
+	render_cache.slots[render_cache_slot(state, hash)] = id + 1;
+}
+
+/*
+ * Checks the header of a cache file and returns the offset of the records,
+ * or zero if the file is invalid.
+ */
+static u64
+render_cache_check(struct qm_buffer *file, struct qm_render_header *header)
+{
+	if (file->size < sizeof(*header)) {
+		return 0;
+	}
+
+	memcpy(header, file->data, sizeof(*header));
+	u64 ticks_size = (u64)header->record_count * sizeof(u32);
+	u64 index_size = ticks_size +
+		(u64)header->record_count * sizeof(struct qm_render_record);
+	u64 start = sizeof(*header) + ticks_size;
+	if (memcmp(header->magic, render_cache_magic,
+				sizeof(header->magic)) != 0 ||
+			header->version != QM_RENDER_CACHE_VERSION ||
+			file->size - sizeof(*header) < index_size ||
+			file->size - sizeof(*header) - index_size != header->data_size ||
+			header->checksum != image_hash(file->data + start,
+				file->size - start)) {
+		return 0;
+	}
+
+	return start;
+}
+
+/*
+ * Adds the entries of a cache file, which has to stay alive as long as the
+ * entries are used. Returns the tick of the file, or zero if it is invalid.
+ */
+static u64
+render_cache_read(struct qm_buffer *file, struct qm_render_header *header)
+{
+	u64 start = render_cache_check(file, header);
+	if (start == 0) {
+		return 0;
+	}
+
+	const u8 *ticks = file->data + sizeof(*header);
+	const u8 *records = file->data + start;
+	const u8 *data = records +
+		(u64)header->record_count * sizeof(struct qm_render_record);
+	for (u32 i = 0; i < header->record_count; i++) {
+		struct qm_render_record record;
+		u32 tick;
+		memcpy(&record, records + i * sizeof(record), sizeof(record));
+		memcpy(&tick, ticks + i * sizeof(tick), sizeof(tick));
+		if (record.offset <= header->data_size &&
+				record.size <= header->data_size - record.offset) {
+			render_cache_add(record.state, record.hash, data + record.offset,
+				record.size, tick, i + 1);
+		}
+	}
+
+	return header->tick;
+}
+
+static void
+render_cache_load(void)
+{
+	struct qm_render_header header = {0};
+	render_cache.tick = 1;
+	if (file_map(render_cache.path, &render_cache.file, false) ||
+			file_read(render_cache.path, 0, &render_cache.file)) {
+		render_cache.tick = render_cache_read(&render_cache.file, &header) + 1;
+	}
+
+	render_cache.checksum = header.checksum;
+	render_cache.record_count = header.record_count;
+}
+
+/* Opens the cache in the directory, which is created if it is missing. */
+static bool
+render_cache_open(const char *directory, u64 limit)
+{
+	if (mkdir(directory, 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Failed to create directory '%s': %s\n", directory,
+			strerror(errno));
+		return false;
+	}
+
+	int length = snprintf(render_cache.path, sizeof(render_cache.path),
+		"%s/render.cache", directory);
+	snprintf(render_cache.lock_path, sizeof(render_cache.lock_path),
+		"%s/render.lock", directory);
+	if (length < 0 || (usize)length + 1 >= sizeof(render_cache.path)) {
+		fprintf(stderr, "Path of the cache is too long: %s\n", directory);
+		return false;
+	}
+
+	render_cache.is_enabled = true;
+	render_cache.limit = limit ? limit : QM_RENDER_CACHE_SIZE;
+	render_cache_load();
+	return true;
+}
+
+/* Starts a document, which is rendered with the macros of the given hash. */
+static void
+render_cache_begin(u64 source_hash)
+{
+	render_cache.state = render_cache_combine(QM_RENDER_CACHE_VERSION,
+		source_hash);
+}
+
+/*
+ * Returns the rendered block, the hash of the source is set either way.
+ * Blocks with definitions are never found, since they are never cached, so
+ * the blocks which are not found are only counted by render_cache_miss once
+ * they turned out to have no definitions.
+ */
+static bool
+render_cache_find(const u8 *source, usize size, u64 *hash,
+		struct qm_string *result)
+{
+	*hash = image_hash(source, size);
+	struct qm_render_entry *entry = render_cache_lookup(render_cache.state,
+		*hash);
+	if (!entry) {
+		return false;
+	}
+
+	if (entry->tick != render_cache.tick) {
+		entry->tick = render_cache.tick;
+		render_cache.is_touched = true;
+	}
+
+	result->data = (u8 *)entry->data;
+	result->size = entry->size;
+	render_cache.stats.hits++;
+	return true;
+}
+
+static void
+render_cache_miss(void)
+{
+	render_cache.stats.misses++;
+}
+
+static void
+render_cache_insert(u64 state, u64 hash, const u8 *data, usize size)
+{
+	if (size > UINT32_MAX || size > render_cache.limit / 2) {
+		return;
+	}
+
+	u8 *copy = arena_alloc(&render_cache.arena, MAX(size, 1), u8);
+	if (size > 0) {
+		memcpy(copy, data, size);
+	}
+
+	render_cache_add(state, hash, copy, size, render_cache.tick, 0);
+	render_cache.is_dirty = true;
+}
+
+/* The block of the source contains definitions, which change the state. */
+static void
+render_cache_define(u64 hash)
+{
+	render_cache.state = render_cache_combine(render_cache.state, hash);
+}
+
+static int
+render_cache_compare(const void *a, const void *b)
+{
+	const struct qm_render_entry *left = a;
+	const struct qm_render_entry *right = b;
+	return (left->tick < right->tick) - (left->tick > right->tick);
+}
+
+static void
+render_cache_reset(void)
+{
+	file_close(&render_cache.file);
+	arena_finish(&render_cache.arena);
+	free(render_cache.entries);
+	free(render_cache.slots);
+	render_cache.file = (struct qm_buffer){0};
+	render_cache.arena = (struct qm_memory_arena){0};
+	render_cache.entries = 0;
+	render_cache.slots = 0;
+	render_cache.entry_count = render_cache.entry_capacity = 0;
+	render_cache.slot_count = 0;
+}
+
+#if QM_FILE_LOCK
+/*
+ * Writes the ticks of the used entries into the loaded file. Fails if the
+ * file was replaced since it was loaded, since the records could differ.
+ */
+static bool
+render_cache_touch(void)
+{
+	int fd = open(render_cache.path, O_RDWR);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct qm_render_header header;
+	bool result = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+		memcmp(header.magic, render_cache_magic, sizeof(header.magic)) == 0 &&
+		header.version == QM_RENDER_CACHE_VERSION &&
+		header.checksum == render_cache.checksum &&
+		header.record_count == render_cache.record_count;
+	for (u32 i = 0; result && i < render_cache.entry_count; i++) {
+		struct qm_render_entry *entry = &render_cache.entries[i];
+		if (entry->record != 0 && entry->tick == render_cache.tick) {
+			off_t offset = sizeof(header) + (off_t)(entry->record - 1) *
+				sizeof(entry->tick);
+			result = pwrite(fd, &entry->tick, sizeof(entry->tick), offset) ==
+				sizeof(entry->tick);
+		}
+	}
+
+	if (result && header.tick < render_cache.tick) {
+		header.tick = render_cache.tick;
+		result = pwrite(fd, &header.tick, sizeof(header.tick),
+			offsetof(struct qm_render_header, tick)) == sizeof(header.tick);
+	}
+
+	result &= close(fd) == 0;
+	return result;
+}
+#endif
+
+/*
+ * Writes the entries to the file, starting with the most recently used ones
+ * until the limit is reached, and loads it again.
+ */
+static void
+render_cache_write(void)
+{
+	/* NOTE: other processes could have saved their entries in the meantime. */
+	struct qm_render_header header = {0};
+	struct qm_buffer current = {0};
+	u64 tick = render_cache.tick;
+	if (file_map(render_cache.path, &current, false) ||
+			file_read(render_cache.path, 0, &current)) {
+		tick = MAX(tick, render_cache_read(&current, &header));
+	}
+
+	struct qm_render_entry *entries = render_cache.entries;
+	u32 entry_count = render_cache.entry_count;
+	qsort(entries, entry_count, sizeof(*entries), render_cache_compare);
+
+	usize entry_size = sizeof(u32) + sizeof(struct qm_render_record);
+	u64 data_size = 0;
+	u32 record_count = 0;
+	while (record_count < entry_count) {
+		u64 size = sizeof(header) + (record_count + 1) * entry_size +
+			data_size + entries[record_count].size;
+		if (size > render_cache.limit) {
+			break;
+		}
+
+		data_size += entries[record_count++].size;
+	}
+
+	render_cache.stats.evictions += entry_count - record_count;
+
+	usize start = sizeof(header) + record_count * sizeof(u32);
+	usize records_size = record_count * sizeof(struct qm_render_record);
+	usize file_size = start + records_size + data_size;
+	u8 *file = malloc(file_size);
+	if (!file) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	u64 offset = 0;
+	for (u32 i = 0; i < record_count; i++) {
+		struct qm_render_record record = {0};
+		record.state = entries[i].state;
+		record.hash = entries[i].hash;
+		record.offset = offset;
+		record.size = entries[i].size;
+		memcpy(file + sizeof(header) + i * sizeof(u32), &entries[i].tick,
+			sizeof(u32));
+		memcpy(file + start + i * sizeof(record), &record, sizeof(record));
+		memcpy(file + start + records_size + offset, entries[i].data,
+			entries[i].size);
+		offset += entries[i].size;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, render_cache_magic, sizeof(header.magic));
+	header.version = QM_RENDER_CACHE_VERSION;
+	header.record_count = record_count;
+	header.tick = tick;
+	header.data_size = data_size;
+	header.checksum = image_hash(file + start, file_size - start);
+	memcpy(file, &header, sizeof(header));
+
+	char tmp_path[sizeof(render_cache.path) + 4];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", render_cache.path);
+	FILE *f = fopen(tmp_path, "wb");
+	bool is_written = f && fwrite(file, 1, file_size, f) == file_size;
+	is_written &= f && fclose(f) == 0;
+	if (!is_written || rename(tmp_path, render_cache.path) != 0) {
+		fprintf(stderr, "Failed to write file '%s': %s\n", render_cache.path,
+			strerror(errno));
+		remove(tmp_path);
+	}
+
+	free(file);
+	render_cache_reset();
+	file_close(&current);
+	render_cache_load();
+}
+
+/*
+ * Saves the cache if anything changed. The file is only rewritten for new
+ * entries, while the ticks of the used entries are written in place.
+ */
+static void
+render_cache_save(void)
+{
+	if (!render_cache.is_enabled ||
+			(!render_cache.is_dirty && !render_cache.is_touched)) {
+		return;
+	}
+
+#if QM_FILE_LOCK
+	int lock = open(render_cache.lock_path, O_RDWR | O_CREAT, 0666);
+	if (lock >= 0) {
+		flock(lock, LOCK_EX);
+	}
+
+	if (render_cache.is_dirty || !render_cache_touch()) {
+		render_cache_write();
+	}
+
+	if (lock >= 0) {
+		close(lock);
+	}
+#else
+	render_cache_write();
+#endif
+
+	render_cache.is_dirty = false;
+	render_cache.is_touched = false;
+}
+
+static void
+render_cache_finish(void)
+{
+	render_cache_save();
+	render_cache_reset();
+}
@@ -0,0 +1,257 @@
+/*
+ * Statistics about the memory of the arenas and the hash tables, which are
+ * printed at exit with --stats. The counters are compiled out if QM_STATS is
+ * defined to 0. Each thread counts its own allocations, which are merged
+ * when a worker is done, and only the main thread counts probes, since the
+ * tables are shared.
+ */
+
+#if QM_STATS
+static const char *phase_name[QM_PHASE_COUNT] = {
+	[QM_PHASE_MACROS] = "macros",
+	[QM_PHASE_SCAN]   = "scan",
+	[QM_PHASE_PARSE]  = "parse",
+	[QM_PHASE_EVAL]   = "eval",
+};
+
+struct qm_stats {
+	u32 phase;
+	u64 phase_bytes[QM_PHASE_COUNT];
+
+	/* NOTE: includes the padding for the alignment. */
+	u64 used_bytes;
+	u64 peak_bytes;
+
+	u64 block_count;
+	u64 block_bytes;
+	u64 wasted_bytes;
+
+	u64 range_count;
+	u64 reserved_bytes;
+	u64 committed_bytes;
+
+	bool is_worker;
+};
+
+static _Thread_local struct qm_stats stats;
+
+static void
+stats_phase(u32 phase)
+{
+	assert(phase < QM_PHASE_COUNT);
+	stats.phase = phase;
+}
+
+static void
+stats_alloc(usize size, usize used)
+{
+	stats.phase_bytes[stats.phase] += size;
+	stats.used_bytes += used;
+	stats.peak_bytes = MAX(stats.peak_bytes, stats.used_bytes);
+}
+
+static void
+stats_free(usize used)
+{
+	assert(used <= stats.used_bytes);
+	stats.used_bytes -= used;
+}
+
+/* NOTE: the tail of the previous block can't be used anymore. */
+static void
+stats_block(usize size, usize wasted)
+{
+	stats.block_count++;
+	stats.block_bytes += size;
+	stats.wasted_bytes += wasted;
+}
+
+#if QM_ARENA_MMAP
+static void
+stats_reserve(usize size)
+{
+	stats.range_count++;
+	stats.reserved_bytes += size;
+}
+
+static void
+stats_commit(usize size)
+{
+	stats.committed_bytes += size;
+}
+#endif
+
+#if QM_THREADS
+/* NOTE: the peaks of the threads are added, as if they overlapped. */
+static void
+stats_merge(struct qm_stats *worker)
+{
+	for (u32 i = 0; i < QM_PHASE_COUNT; i++) {
+		stats.phase_bytes[i] += worker->phase_bytes[i];
+	}
+
+	stats.peak_bytes += worker->peak_bytes;
+	stats.block_count += worker->block_count;
+	stats.block_bytes += worker->block_bytes;
+	stats.wasted_bytes += worker->wasted_bytes;
+	stats.range_count += worker->range_count;
+	stats.reserved_bytes += worker->reserved_bytes;
+	stats.committed_bytes += worker->committed_bytes;
+}
+#endif
+
+static void
+stats_probe(struct qm_probe_stats *probes, u32 length)
+{
+	if (stats.is_worker) {
+		return;
+	}
+
+	probes->lookups++;
+	probes->histogram[MIN(length, QM_PROBE_BUCKETS - 1)]++;
+}
+
+static void
+stats_report_table(FILE *file, bool json, const char *name, u32 index,
+		u32 used, u32 size, struct qm_probe_stats *probes)
+{
+	f64 load = size ? (f64)used / size : 0;
+	u32 buckets = QM_PROBE_BUCKETS;
+	while (buckets > 0 && probes->histogram[buckets - 1] == 0) {
+		buckets--;
+	}
+
+	if (json) {
+		fprintf(file, "{\"name\":\"%s\",\"index\":%u,\"used\":%u,\"size\":%u,"
+			"\"load\":%.3f,\"lookups\":%llu,\"probes\":[", name, index,
+			used, size, load, (unsigned long long)probes->lookups);
+		for (u32 i = 0; i < buckets; i++) {
+			fprintf(file, "%s%llu", i ? "," : "",
+				(unsigned long long)probes->histogram[i]);
+		}
+
+		fprintf(file, "]}");
+	} else {
+		fprintf(file, "stats: %s %u: %u/%u slots used (load %.2f), "
+			"%llu lookups, probes:", name, index, used, size, load,
+			(unsigned long long)probes->lookups);
+		for (u32 i = 0; i < buckets; i++) {
+			fprintf(file, " %u%s:%llu", i, i == QM_PROBE_BUCKETS - 1 ? "+" : "",
+				(unsigned long long)probes->histogram[i]);
+		}
+
+		fprintf(file, "\n");
+	}
+}
+#else
+#define stats_phase(phase) ((void)0)
+#define stats_alloc(size, used) ((void)0)
+#define stats_free(used) ((void)0)
+#define stats_block(size, wasted) ((void)0)
+#define stats_reserve(size) ((void)0)
+#define stats_commit(size) ((void)0)
+#define stats_probe(probes, length) ((void)0)
+#endif
+
+static void
+stats_report_cache(FILE *file, struct qm_cache_stats *cache)
+{
+	fprintf(file, "stats: render cache: %llu hits, %llu misses, "
+		"%llu evictions\n", (unsigned long long)cache->hits,
+		(unsigned long long)cache->misses,
+		(unsigned long long)cache->evictions);
+}
+
+/*
+ * Prints the statistics of the arenas, the operators and the environments,
+ * and of the render cache unless it is null.
+ */
+static void
+stats_report(FILE *file, bool json, struct qm_operator_table *operators,
+		struct tex_environment *env, struct qm_cache_stats *cache)
+{
+#if QM_STATS
+	if (json) {
+		fprintf(file, "{\"phases\":{");
+		for (u32 i = 0; i < QM_PHASE_COUNT; i++) {
+			fprintf(file, "%s\"%s\":%llu", i ? "," : "", phase_name[i],
+				(unsigned long long)stats.phase_bytes[i]);
+		}
+
+		fprintf(file, "},\"peak_bytes\":%llu,\"blocks\":%llu,"
+			"\"block_bytes\":%llu,\"wasted_bytes\":%llu,\"ranges\":%llu,"
+			"\"reserved_bytes\":%llu,\"committed_bytes\":%llu,\"tables\":[",
+			(unsigned long long)stats.peak_bytes,
+			(unsigned long long)stats.block_count,
+			(unsigned long long)stats.block_bytes,
+			(unsigned long long)stats.wasted_bytes,
+			(unsigned long long)stats.range_count,
+			(unsigned long long)stats.reserved_bytes,
+			(unsigned long long)stats.committed_bytes);
+	} else {
+		fprintf(file, "stats: arena bytes by phase:");
+		for (u32 i = 0; i < QM_PHASE_COUNT; i++) {
+			fprintf(file, " %s %llu", phase_name[i],
+				(unsigned long long)stats.phase_bytes[i]);
+		}
+
+		u64 wasted_per_block = 0;
+		if (stats.block_count > 0) {
+			wasted_per_block = stats.wasted_bytes / stats.block_count;
+		}
+
+		fprintf(file, "\nstats: peak %llu bytes in use\n",
+			(unsigned long long)stats.peak_bytes);
+		/* NOTE: the mmap arenas grow in place and have no blocks. */
+		if (stats.block_count > 0 || stats.range_count == 0) {
+			fprintf(file, "stats: %llu blocks of %llu bytes, %llu bytes "
+				"wasted (%llu per block)\n",
+				(unsigned long long)stats.block_count,
+				(unsigned long long)stats.block_bytes,
+				(unsigned long long)stats.wasted_bytes,
+				(unsigned long long)wasted_per_block);
+		}
+
+		if (stats.range_count > 0) {
+			fprintf(file, "stats: %llu ranges of %llu bytes reserved, "
+				"%llu bytes committed\n",
+				(unsigned long long)stats.range_count,
+				(unsigned long long)stats.reserved_bytes,
+				(unsigned long long)stats.committed_bytes);
+		}
+	}
+
+	stats_report_table(file, json, "operators", 0, operators->used,
+		operators->size, &operators->probes);
+	for (u32 i = 0; env; env = env->parent, i++) {
+		if (json) {
+			fprintf(file, ",");
+		}
+
+		stats_report_table(file, json, "environment", i, env->used,
+			env->size, &env->probes);
+	}
+
+	if (json) {
+		fprintf(file, "]");
+		if (cache) {
+			fprintf(file, ",\"render_cache\":{\"hits\":%llu,\"misses\":%llu,"
+				"\"evictions\":%llu}", (unsigned long long)cache->hits,
+				(unsigned long long)cache->misses,
+				(unsigned long long)cache->evictions);
+		}
+
+		fprintf(file, "}\n");
+	} else if (cache) {
+		stats_report_cache(file, cache);
+	}
+#else
+	(void)json;
+	(void)operators;
+	(void)env;
+	fprintf(file, "stats: not available, compiled with QM_STATS=0\n");
+	if (cache) {
+		stats_report_cache(file, cache);
+	}
+#endif
+}
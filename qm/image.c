@@ -0,0 +1,517 @@
+/*
+ * A compiled macro library is an image of the symbols, the operators and the
+ * global environment after the macros were evaluated, so that they don't
+ * have to be parsed and evaluated again. The image is only valid for the
+ * source it was compiled from, which is identified by its hash.
+ *
+ * The objects are written as they are in memory, except that the pointers
+ * are offsets from the start of the image. The offsets of all pointers are
+ * listed in the relocations, so the image is mapped privately and each
+ * pointer is turned back into an address by adding the base. Objects which
+ * are shared, like the code of a function bound to two names, are written
+ * once, since the memo and the purity depend on the identity of the code.
+ */
+
+#define QM_IMAGE_VERSION 1
+
+struct qm_image_symbol {
+	u64 name;
+	u32 length;
+	u32 flags;
+	u32 version;
+};
+
+struct qm_image_header {
+	u8 magic[8];
+	u32 version;
+	u32 pointer_size;
+	u32 value_size;
+	u32 code_size;
+	u64 source_hash;
+	/* NOTE: the hash of everything after the header. */
+	u64 checksum;
+	u64 size;
+
+	u64 relocations;
+	u64 relocation_count;
+
+	u64 symbols;
+	u32 symbol_count;
+	i32 bp;
+
+	u64 operator_keys;
+	u64 operator_hashes;
+	u64 operator_values;
+	u32 operator_used;
+	u32 operator_size;
+
+	u64 env_keys;
+	u64 env_values;
+	u32 env_used;
+	u32 env_size;
+	u32 env_version;
+};
+
+static const u8 image_magic[8] = "qmimage";
+
+struct qm_image_writer {
+	u8 *data;
+	usize size;
+	usize capacity;
+
+	u64 *relocations;
+	u32 relocation_count;
+	u32 relocation_capacity;
+
+	/* NOTE: maps the address and size of an object to its offset. */
+	uintptr_t *addresses;
+	usize *sizes;
+	u64 *offsets;
+	u32 used;
+	u32 slot_count;
+};
+
+/*
+ * Hashes the words in four independent lanes, so that the multiplications
+ * overlap instead of waiting for each other.
+ */
+static u64
+image_hash(const u8 *data, usize size)
+{
+	u64 lanes[4] = {
+		0x243f6a8885a308d3ull, 0x13198a2e03707344ull,
+		0xa4093822299f31d0ull, 0x082efa98ec4e6c89ull,
+	};
+
+	usize i = 0;
+	for (; i + sizeof(lanes) <= size; i += sizeof(lanes)) {
+		for (u32 j = 0; j < 4; j++) {
+			u64 word;
+			memcpy(&word, data + i + j * sizeof(word), sizeof(word));
+			lanes[j] = (lanes[j] ^ word) * 0x9e3779b97f4a7c15ull;
+			lanes[j] ^= lanes[j] >> 32;
+		}
+	}
+
+	u64 h = size;
+	for (u32 j = 0; j < 4; j++) {
+		h = (h ^ lanes[j]) * 0x100000001b3ull;
+	}
+
+	for (; i < size; i++) {
+		h = (h ^ data[i]) * 0x100000001b3ull;
+	}
+
+	return h ^ (h >> 29);
+}
+
+/* Returns the offset of zeroed memory, which is aligned for any object. */
+static u64
+image_alloc(struct qm_image_writer *writer, usize size)
+{
+	usize offset = (writer->size + 7) & ~(usize)7;
+	if (offset + size > writer->capacity) {
+		writer->capacity = MAX(2 * writer->capacity, offset + size + 4096);
+		writer->data = realloc(writer->data, writer->capacity);
+		if (!writer->data) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memset(writer->data + writer->size, 0, offset + size - writer->size);
+	writer->size = offset + size;
+	return offset;
+}
+
+/* Stores the offset of the target in the pointer at the given offset. */
+static void
+image_pointer(struct qm_image_writer *writer, u64 offset, u64 target)
+{
+	uintptr_t pointer = target;
+	memcpy(writer->data + offset, &pointer, sizeof(pointer));
+	if (!target) {
+		return;
+	}
+
+	if (writer->relocation_count == writer->relocation_capacity) {
+		writer->relocation_capacity = MAX(2 * writer->relocation_capacity, 256);
+		writer->relocations = realloc(writer->relocations,
+			writer->relocation_capacity * sizeof(*writer->relocations));
+		if (!writer->relocations) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	writer->relocations[writer->relocation_count++] = offset;
+}
+
+static u32
+image_slot(struct qm_image_writer *writer, const void *address, usize size)
+{
+	u32 mask = writer->slot_count - 1;
+	u32 i = (u32)(((uintptr_t)address >> 3) * 2654435761u) & mask;
+	while (writer->addresses[i] && (writer->addresses[i] != (uintptr_t)address
+			|| writer->sizes[i] != size)) {
+		i = (i + 1) & mask;
+	}
+
+	return i;
+}
+
+/* Returns the offset of an object which was already written, or zero. */
+static u64
+image_find(struct qm_image_writer *writer, const void *address, usize size)
+{
+	if (writer->slot_count == 0) {
+		return 0;
+	}
+
+	u32 i = image_slot(writer, address, size);
+	return writer->addresses[i] ? writer->offsets[i] : 0;
+}
+
+static void
+image_insert(struct qm_image_writer *writer, const void *address, usize size,
+		u64 offset)
+{
+	if (2 * (writer->used + 1) > writer->slot_count) {
+		u32 old_count = writer->slot_count;
+		uintptr_t *old_addresses = writer->addresses;
+		usize *old_sizes = writer->sizes;
+		u64 *old_offsets = writer->offsets;
+
+		writer->slot_count = MAX(2 * old_count, 1024);
+		writer->addresses = calloc(writer->slot_count, sizeof(uintptr_t));
+		writer->sizes = calloc(writer->slot_count, sizeof(usize));
+		writer->offsets = calloc(writer->slot_count, sizeof(u64));
+		if (!writer->addresses || !writer->sizes || !writer->offsets) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+
+		for (u32 j = 0; j < old_count; j++) {
+			if (old_addresses[j]) {
+				u32 i = image_slot(writer, (void *)old_addresses[j],
+					old_sizes[j]);
+				writer->addresses[i] = old_addresses[j];
+				writer->sizes[i] = old_sizes[j];
+				writer->offsets[i] = old_offsets[j];
+			}
+		}
+
+		free(old_addresses);
+		free(old_sizes);
+		free(old_offsets);
+	}
+
+	u32 i = image_slot(writer, address, size);
+	writer->addresses[i] = (uintptr_t)address;
+	writer->sizes[i] = size;
+	writer->offsets[i] = offset;
+	writer->used++;
+}
+
+/* NOTE: empty arrays keep a valid address, only null stays null. */
+static u64
+image_bytes(struct qm_image_writer *writer, const void *data, usize size)
+{
+	if (!data) {
+		return 0;
+	}
+
+	u64 offset = image_alloc(writer, MAX(size, 1));
+	memcpy(writer->data + offset, data, size);
+	return offset;
+}
+
+static u64 image_values(struct qm_image_writer *writer,
+	const struct tex_value *values, u32 count);
+
+static u64
+image_code(struct qm_image_writer *writer, const struct tex_code *code)
+{
+	if (!code) {
+		return 0;
+	}
+
+	u64 offset = image_find(writer, code, sizeof(*code));
+	if (offset) {
+		return offset;
+	}
+
+	offset = image_alloc(writer, sizeof(*code));
+	memcpy(writer->data + offset, code, sizeof(*code));
+	image_insert(writer, code, sizeof(*code), offset);
+
+	image_pointer(writer, offset + offsetof(struct tex_code, ops),
+		image_bytes(writer, code->ops, code->op_count * sizeof(u32)));
+	image_pointer(writer, offset + offsetof(struct tex_code, constants),
+		image_values(writer, code->constants, code->constant_count));
+	image_pointer(writer, offset + offsetof(struct tex_code, parameters),
+		image_bytes(writer, code->parameters,
+			code->parameter_count * sizeof(u32)));
+	image_pointer(writer, offset + offsetof(struct tex_code, optimized),
+		image_code(writer, code->optimized));
+	image_pointer(writer, offset + offsetof(struct tex_code, assumptions),
+		image_bytes(writer, code->assumptions,
+			code->assumption_count * sizeof(struct tex_assumption)));
+	return offset;
+}
+
+/* Writes the pointers of a value, which was copied to the given offset. */
+static void
+image_value(struct qm_image_writer *writer, u64 offset,
+		const struct tex_value *value)
+{
+	switch (value->type) {
+	case TEX_VALUE_FUNCTION:
+		image_pointer(writer, offset + offsetof(struct tex_value, function.code),
+			image_code(writer, value->function.code));
+		break;
+	case TEX_VALUE_MATRIX:
+		image_pointer(writer, offset + offsetof(struct tex_value, matrix.values),
+			image_values(writer, value->matrix.values,
+				value->matrix.width * value->matrix.height));
+		break;
+	case TEX_VALUE_STRING:
+	case TEX_VALUE_RAW_STRING:
+		image_pointer(writer, offset + offsetof(struct tex_value, string.data),
+			image_bytes(writer, value->string.data, value->string.size));
+		break;
+	case TEX_VALUE_CONCAT:
+		image_pointer(writer, offset + offsetof(struct tex_value, concat.left),
+			image_values(writer, value->concat.left, 1));
+		image_pointer(writer, offset + offsetof(struct tex_value, concat.right),
+			image_values(writer, value->concat.right, 1));
+		break;
+	default:
+		break;
+	}
+}
+
+static u64
+image_values(struct qm_image_writer *writer, const struct tex_value *values,
+		u32 count)
+{
+	if (!values) {
+		return 0;
+	}
+
+	usize size = count * sizeof(*values);
+	u64 offset = image_find(writer, values, size);
+	if (offset) {
+		return offset;
+	}
+
+	offset = image_bytes(writer, values, size);
+	image_insert(writer, values, size, offset);
+	for (u32 i = 0; i < count; i++) {
+		image_value(writer, offset + i * sizeof(*values), &values[i]);
+	}
+
+	return offset;
+}
+
+/*
+ * Writes the image of the library to the file. The image is written to a
+ * temporary file first, so that readers never see a partial image.
+ */
+static bool
+image_write(const char *path, u64 source_hash,
+		struct qm_operator_table *operators, i32 bp,
+		struct tex_environment *env)
+{
+	struct qm_image_writer writer = {0};
+	struct qm_image_header header = {0};
+	image_alloc(&writer, sizeof(header));
+
+	memcpy(header.magic, image_magic, sizeof(header.magic));
+	header.version = QM_IMAGE_VERSION;
+	header.pointer_size = sizeof(void *);
+	header.value_size = sizeof(struct tex_value);
+	header.code_size = sizeof(struct tex_code);
+	header.source_hash = source_hash;
+	header.bp = bp;
+
+	header.symbol_count = symbols.count;
+	header.symbols = image_alloc(&writer,
+		symbols.count * sizeof(struct qm_image_symbol));
+	for (u32 id = 1; id < symbols.count; id++) {
+		struct qm_symbol *symbol = &symbols.symbols[id];
+		struct qm_image_symbol image_symbol = {0};
+		image_symbol.name = image_bytes(&writer, symbol->name, symbol->length);
+		image_symbol.length = symbol->length;
+		image_symbol.flags = symbol->flags;
+		image_symbol.version = symbol->version;
+		memcpy(writer.data + header.symbols + id * sizeof(image_symbol),
+			&image_symbol, sizeof(image_symbol));
+	}
+
+	/* NOTE: the entries of empty slots are uninitialized, so they are skipped. */
+	header.operator_used = operators->used;
+	header.operator_size = operators->size;
+	header.operator_keys = image_bytes(&writer, operators->keys,
+		operators->size * sizeof(u32));
+	header.operator_hashes = image_alloc(&writer,
+		operators->size * sizeof(u32));
+	header.operator_values = image_alloc(&writer,
+		operators->size * sizeof(struct qm_operator));
+	for (u32 i = 0; i < operators->size; i++) {
+		if (operators->keys[i]) {
+			memcpy(writer.data + header.operator_hashes + i * sizeof(u32),
+				&operators->hashes[i], sizeof(u32));
+			memcpy(writer.data + header.operator_values +
+				i * sizeof(struct qm_operator), &operators->values[i],
+				sizeof(struct qm_operator));
+		}
+	}
+
+	header.env_used = env->used;
+	header.env_size = env->size;
+	header.env_version = env->version;
+	header.env_keys = image_bytes(&writer, env->keys, env->size * sizeof(u32));
+	header.env_values = image_alloc(&writer,
+		env->size * sizeof(struct tex_value));
+	for (u32 i = 0; i < env->size; i++) {
+		if (env->keys[i]) {
+			u64 offset = header.env_values + i * sizeof(struct tex_value);
+			memcpy(writer.data + offset, &env->values[i],
+				sizeof(struct tex_value));
+			image_value(&writer, offset, &env->values[i]);
+		}
+	}
+
+	header.relocation_count = writer.relocation_count;
+	header.relocations = image_bytes(&writer, writer.relocations,
+		writer.relocation_count * sizeof(u64));
+	header.size = writer.size;
+	header.checksum = image_hash(writer.data + sizeof(header),
+		writer.size - sizeof(header));
+	memcpy(writer.data, &header, sizeof(header));
+
+	char tmp_path[4096];
+	bool is_written = false;
+	if ((usize)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) <
+			sizeof(tmp_path)) {
+		FILE *file = fopen(tmp_path, "wb");
+		if (file) {
+			is_written = fwrite(writer.data, 1, writer.size, file) ==
+				writer.size;
+			is_written &= fclose(file) == 0;
+			is_written = is_written && rename(tmp_path, path) == 0;
+			if (!is_written) {
+				remove(tmp_path);
+			}
+		}
+	}
+
+	free(writer.data);
+	free(writer.relocations);
+	free(writer.addresses);
+	free(writer.sizes);
+	free(writer.offsets);
+	return is_written;
+}
+
+static bool
+image_in_bounds(struct qm_image_header *header, u64 offset, u64 size)
+{
+	return offset <= header->size && size <= header->size - offset;
+}
+
+/*
+ * Relocates the image in place and loads the symbols, the operators and the
+ * environment from it. Fails if the image was compiled by a different build
+ * or from a different source, the symbols must not be used then.
+ */
+static bool
+image_load(u8 *data, usize size, u64 source_hash,
+		struct qm_operator_table *operators, i32 *bp,
+		struct tex_environment *env)
+{
+	struct qm_image_header header;
+	if (size < sizeof(header)) {
+		return false;
+	}
+
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, image_magic, sizeof(header.magic)) != 0 ||
+			header.version != QM_IMAGE_VERSION ||
+			header.pointer_size != sizeof(void *) ||
+			header.value_size != sizeof(struct tex_value) ||
+			header.code_size != sizeof(struct tex_code) ||
+			header.source_hash != source_hash ||
+			header.size != size ||
+			header.checksum != image_hash(data + sizeof(header),
+				size - sizeof(header)) ||
+			!image_in_bounds(&header, header.relocations,
+				header.relocation_count * sizeof(u64)) ||
+			!image_in_bounds(&header, header.symbols,
+				header.symbol_count * sizeof(struct qm_image_symbol)) ||
+			!image_in_bounds(&header, header.operator_keys,
+				header.operator_size * sizeof(u32)) ||
+			!image_in_bounds(&header, header.operator_hashes,
+				header.operator_size * sizeof(u32)) ||
+			!image_in_bounds(&header, header.operator_values,
+				header.operator_size * sizeof(struct qm_operator)) ||
+			!image_in_bounds(&header, header.env_keys,
+				header.env_size * sizeof(u32)) ||
+			!image_in_bounds(&header, header.env_values,
+				header.env_size * sizeof(struct tex_value)) ||
+			header.symbol_count < QM_SYMBOL_COUNT ||
+			header.operator_size == 0) {
+		return false;
+	}
+
+	u8 *relocations = data + header.relocations;
+	for (u64 i = 0; i < header.relocation_count; i++) {
+		u64 offset;
+		uintptr_t pointer;
+		memcpy(&offset, relocations + i * sizeof(offset), sizeof(offset));
+		if (!image_in_bounds(&header, offset, sizeof(pointer))) {
+			return false;
+		}
+
+		memcpy(&pointer, data + offset, sizeof(pointer));
+		if (pointer >= size) {
+			return false;
+		}
+
+		pointer += (uintptr_t)data;
+		memcpy(data + offset, &pointer, sizeof(pointer));
+	}
+
+	/* NOTE: the symbols are interned in order, so they keep their ids. */
+	for (u32 id = 1; id < header.symbol_count; id++) {
+		struct qm_image_symbol symbol;
+		memcpy(&symbol, data + header.symbols + id * sizeof(symbol),
+			sizeof(symbol));
+		if (!image_in_bounds(&header, symbol.name, symbol.length) ||
+				symbol_intern(data + symbol.name, symbol.length) != id) {
+			return false;
+		}
+
+		symbols.symbols[id].flags = symbol.flags;
+		symbols.symbols[id].version = symbol.version;
+	}
+
+	/* NOTE: the tables are never empty, the unwrap operator is predefined. */
+	operators->keys = (u32 *)(data + header.operator_keys);
+	operators->hashes = (u32 *)(data + header.operator_hashes);
+	operators->values = (struct qm_operator *)(data + header.operator_values);
+	operators->used = header.operator_used;
+	operators->size = header.operator_size;
+	*bp = header.bp;
+
+	if (header.env_size > 0) {
+		env->keys = (u32 *)(data + header.env_keys);
+		env->values = (struct tex_value *)(data + header.env_values);
+	}
+
+	env->used = header.env_used;
+	env->size = header.env_size;
+	env->version = header.env_version;
+	return true;
+}
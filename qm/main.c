@@ -1,15 +1,118 @@
+#if !defined(QM_ARENA_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define QM_ARENA_MMAP 1
+#endif
+
+#if !defined(QM_FILE_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define QM_FILE_MMAP 1
+#endif
+
+#if !defined(QM_OUTPUT_WRITEV) && (defined(__unix__) || defined(__APPLE__))
+#define QM_OUTPUT_WRITEV 1
+#endif
+
+#if !defined(QM_THREADS) && (defined(__unix__) || defined(__APPLE__))
+#define QM_THREADS 1
+#endif
+
+#if !defined(QM_SERVER) && (defined(__unix__) || defined(__APPLE__))
+#define QM_SERVER 1
+#endif
+
+#if !defined(QM_FORK) && (defined(__unix__) || defined(__APPLE__))
+#define QM_FORK 1
+#endif
+
+#if !defined(QM_FILE_LOCK) && (defined(__unix__) || defined(__APPLE__))
+#define QM_FILE_LOCK 1
+#endif
+
+#if QM_ARENA_MMAP || QM_FILE_MMAP || QM_OUTPUT_WRITEV || QM_SERVER || \
+	QM_FORK || QM_FILE_LOCK
+#define _DEFAULT_SOURCE
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if QM_ARENA_MMAP || QM_FILE_MMAP || QM_FORK
+#include <sys/mman.h>
+#endif
+
+#if QM_FILE_MMAP || QM_FILE_LOCK
+#include <fcntl.h>
+#endif
+
+/* NOTE: also needed for mkdir, which creates the render cache. */
+#include <sys/stat.h>
+
+#if QM_FILE_LOCK
+#include <sys/file.h>
+#endif
+
+#if QM_FILE_MMAP || QM_OUTPUT_WRITEV || QM_SERVER || QM_FORK || QM_FILE_LOCK
+#include <unistd.h>
+#endif
+
+#if QM_FORK
+#include <sys/wait.h>
+#endif
+
+#if QM_SERVER
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#if QM_OUTPUT_WRITEV
+#include <sys/uio.h>
+#endif
+
+#if QM_THREADS
+#include <pthread.h>
+#include <sys/resource.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <qm/types.h>
 #include <qm/tex.h>
 
+/* NOTE: the vector width is undefined for targets without SSE2. */
+#if defined(__AVX2__)
+#define QM_SIMD_WIDTH 32
+typedef __m256i qm_simd;
+#define simd_load(p)     _mm256_loadu_si256((const __m256i *)(p))
+#define simd_set1(c)     _mm256_set1_epi8((char)(c))
+#define simd_eq(a, b)    _mm256_cmpeq_epi8(a, b)
+#define simd_gt(a, b)    _mm256_cmpgt_epi8(a, b)
+#define simd_or(a, b)    _mm256_or_si256(a, b)
+#define simd_xor(a, b)   _mm256_xor_si256(a, b)
+#define simd_sub(a, b)   _mm256_sub_epi8(a, b)
+#define simd_movemask(a) ((u32)_mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+#define QM_SIMD_WIDTH 16
+typedef __m128i qm_simd;
+#define simd_load(p)     _mm_loadu_si128((const __m128i *)(p))
+#define simd_set1(c)     _mm_set1_epi8((char)(c))
+#define simd_eq(a, b)    _mm_cmpeq_epi8(a, b)
+#define simd_gt(a, b)    _mm_cmpgt_epi8(a, b)
+#define simd_or(a, b)    _mm_or_si128(a, b)
+#define simd_xor(a, b)   _mm_xor_si128(a, b)
+#define simd_sub(a, b)   _mm_sub_epi8(a, b)
+#define simd_movemask(a) ((u32)_mm_movemask_epi8(a))
+#endif
+
 
 static const char *token_name[QM_TOKEN_COUNT] = {
 	[QM_TOKEN_INVALID]    = "INVALID",
@@ -26,47 +129,222 @@ static const char *token_name[QM_TOKEN_COUNT] = {
 	[QM_TOKEN_NUMBER]     = "NUMBER",
 	[QM_TOKEN_STRING]     = "STRING",
 	[QM_TOKEN_RAW_STRING] = "RAW_STRING",
+	[QM_TOKEN_VAR]        = "VAR",
+	[QM_TOKEN_FN]         = "FN",
 	[QM_TOKEN_OP]         = "OP",
 	[QM_TOKEN_OPR]        = "OPR",
 	[QM_TOKEN_OPP]        = "OPP",
 };
 
+#include "debug.c"
+
 static struct qm_memory_block *
 memory_block_create(usize size)
 {
 	usize block_size = MAX(size, 8192);
-	struct qm_memory_block *block = calloc(block_size + sizeof(*block), 1);
+	struct qm_memory_block *block = malloc(block_size + sizeof(*block));
 	if (!block) {
-		perror("calloc");
+		perror("malloc");
 		exit(EXIT_FAILURE);
 	}
 
 	block->size = block_size;
+	block->used = 0;
 	block->data = block + 1;
 	return block;
 }
 
+#if QM_ARENA_MMAP
+static bool arena_huge_pages;
+
+/*
+ * Reserves the address space of the arena without backing it with memory.
+ * Fails if the address space is limited, then the arena uses blocks.
+ */
+static bool
+arena_reserve(struct qm_memory_arena *arena)
+{
+	usize alignment = QM_ARENA_COMMIT_SIZE;
+	if (arena_huge_pages) {
+		alignment = QM_HUGE_PAGE_SIZE;
+	}
+
+	usize size = QM_ARENA_RESERVE_SIZE + alignment;
+	u8 *data = mmap(0, size, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	/* NOTE: huge pages can only be used for aligned ranges. */
+	u8 *base = (u8 *)(((uintptr_t)data + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	u8 *end = base + QM_ARENA_RESERVE_SIZE;
+	if (base != data) {
+		munmap(data, base - data);
+	}
+
+	if (end != data + size) {
+		munmap(end, data + size - end);
+	}
+
+#if defined(MADV_HUGEPAGE)
+	if (arena_huge_pages) {
+		madvise(base, QM_ARENA_RESERVE_SIZE, MADV_HUGEPAGE);
+	}
+#endif
+
+	stats_reserve(QM_ARENA_RESERVE_SIZE);
+	arena->base = base;
+	arena->reserved = QM_ARENA_RESERVE_SIZE;
+	arena->committed = 0;
+	arena->used = 0;
+	arena->dirty = 0;
+	return true;
+}
+
+static void
+arena_commit(struct qm_memory_arena *arena, usize size)
+{
+	usize granularity = QM_ARENA_COMMIT_SIZE;
+	if (arena_huge_pages) {
+		granularity = QM_HUGE_PAGE_SIZE;
+	}
+
+	usize committed = (size + granularity - 1) & ~(granularity - 1);
+	if (committed > arena->reserved) {
+		fprintf(stderr, "error: out of reserved memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (mprotect(arena->base + arena->committed, committed - arena->committed,
+			PROT_READ | PROT_WRITE) != 0) {
+		perror("mprotect");
+		exit(EXIT_FAILURE);
+	}
+
+	stats_commit(committed - arena->committed);
+	arena->committed = committed;
+}
+#endif
+
 static void *
 arena_alloc_(struct qm_memory_arena *arena, usize size)
 {
+#if QM_ARENA_MMAP
+	if (!arena->base && !arena->block) {
+		arena_reserve(arena);
+	}
+
+	if (arena->base) {
+		usize offset = (arena->used + QM_ARENA_ALIGNMENT - 1) & ~(usize)(QM_ARENA_ALIGNMENT - 1);
+		if (offset + size > arena->committed) {
+			arena_commit(arena, offset + size);
+		}
+
+		stats_alloc(size, offset + size - arena->used);
+		arena->used = offset + size;
+		return arena->base + offset;
+	}
+#endif
+
 	struct qm_memory_block *block = arena->block;
-	if (!arena->block || block->used + size > block->size) {
+	usize offset = 0;
+	if (block) {
+		offset = (block->used + QM_ARENA_ALIGNMENT - 1) & ~(usize)(QM_ARENA_ALIGNMENT - 1);
+	}
+
+	if (!block || offset + size > block->size) {
+		struct qm_memory_block **free_block = &arena->free_blocks;
+		while (*free_block && (*free_block)->size < size) {
+			free_block = &(*free_block)->prev;
+		}
+
+		if (*free_block) {
+			block = *free_block;
+			*free_block = block->prev;
+			block->used = 0;
+		} else {
+			block = memory_block_create(size);
+			stats_block(block->size,
+				arena->block ? arena->block->size - arena->block->used : 0);
+		}
 
-		block = memory_block_create(size);
 		block->prev = arena->block;
 		arena->block = block;
+		offset = 0;
 	}
 
-	assert(block->used + size <= block->size);
-	void *ptr = (u8 *)block->data + block->used;
-	block->used += size;
+	stats_alloc(size, offset + size - block->used);
+	assert(offset + size <= block->size);
+	void *ptr = (u8 *)block->data + offset;
+	block->used = offset + size;
+
+	return ptr;
+}
+
+static void *
+arena_alloc_zero_(struct qm_memory_arena *arena, usize size)
+{
+	u8 *ptr = arena_alloc_(arena, size);
+
+	/* NOTE: fresh pages of a reserved range are already zero. */
+	usize dirty_size = size;
+	if (arena->base) {
+		usize offset = ptr - arena->base;
+		dirty_size = arena->dirty > offset ? MIN(arena->dirty - offset, size) : 0;
+	}
 
+	memset(ptr, 0, dirty_size);
 	return ptr;
 }
 
+static struct qm_arena_temp
+arena_begin_temp(struct qm_memory_arena *arena)
+{
+	struct qm_arena_temp temp;
+	temp.arena = arena;
+	temp.block = arena->block;
+	temp.used = arena->block ? arena->block->used : arena->used;
+	return temp;
+}
+
+/* Frees everything which was allocated since the matching arena_begin_temp. */
+static void
+arena_end_temp(struct qm_arena_temp temp)
+{
+	struct qm_memory_arena *arena = temp.arena;
+
+	if (arena->base) {
+		stats_free(arena->used - temp.used);
+		arena->dirty = MAX(arena->dirty, arena->used);
+		arena->used = temp.used;
+		return;
+	}
+
+	while (arena->block != temp.block) {
+		struct qm_memory_block *block = arena->block;
+		stats_free(block->used);
+		arena->block = block->prev;
+		block->prev = arena->free_blocks;
+		arena->free_blocks = block;
+	}
+
+	if (temp.block) {
+		stats_free(temp.block->used - temp.used);
+		temp.block->used = temp.used;
+	}
+}
+
 static void
 arena_finish(struct qm_memory_arena *arena)
 {
+#if QM_ARENA_MMAP
+	if (arena->base) {
+		munmap(arena->base, arena->reserved);
+		arena->base = 0;
+	}
+#endif
+
 	struct qm_memory_block *block = arena->block;
 
 	while (block) {
@@ -74,6 +352,13 @@ arena_finish(struct qm_memory_arena *arena)
 		free(block);
 		block = tmp;
 	}
+
+	block = arena->free_blocks;
+	while (block) {
+		struct qm_memory_block *tmp = block->prev;
+		free(block);
+		block = tmp;
+	}
 }
 
 static usize
@@ -90,40 +375,225 @@ string_length(const u8 *string)
 	return length;
 }
 
-static bool
-string_equals(const u8 *a, const u8 *b)
+static u32
+hash(const u8 *data, u32 length)
 {
-	if (!a) {
-		return false;
-	} else if (!b) {
-		return false;
-	} else {
-		while (*a && *b && *a == *b) {
-			a++;
-			b++;
+	u32 h = 5381;
+
+	while (length-- > 0) {
+		h = (h << 5) + h + *data++;
+	}
+
+	return h;
+}
+
+/*
+ * Every distinct identifier is interned once into the global symbol table.
+ * The rest of the program refers to identifiers by their symbol id, so that
+ * looking up variables and operators only compares integers. Id 0 is never
+ * assigned and marks empty slots in the hash tables keyed by symbols.
+ */
+static struct qm_symbol_table symbols;
+
+static u32
+symbol_intern(const u8 *name, u32 length)
+{
+	struct qm_symbol_table *table = &symbols;
+
+	if (2 * (table->count + 1) > table->slot_count) {
+		u32 slot_count = MAX(2 * table->slot_count, 1024);
+		u32 *slots = calloc(slot_count, sizeof(*slots));
+		if (!slots) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+
+		u32 mask = slot_count - 1;
+		for (u32 id = 1; id < table->count; id++) {
+			u32 i = table->symbols[id].hash & mask;
+			while (slots[i]) {
+				i = (i + 1) & mask;
+			}
+
+			slots[i] = id;
+		}
+
+		free(table->slots);
+		table->slots = slots;
+		table->slot_count = slot_count;
+	}
+
+	u32 h = hash(name, length);
+	u32 mask = table->slot_count - 1;
+	u32 i = h & mask;
+	while (table->slots[i]) {
+		struct qm_symbol *symbol = &table->symbols[table->slots[i]];
+		if (symbol->hash == h && symbol->length == length &&
+				memcmp(symbol->name, name, length) == 0) {
+			return table->slots[i];
 		}
 
-		return *a == *b;
+		i = (i + 1) & mask;
+	}
+
+	if (table->count == 0) {
+		/* NOTE: reserve the id zero for empty slots. */
+		table->count = 1;
+	}
+
+	if (table->count >= table->capacity) {
+		table->capacity = MAX(2 * table->capacity, 1024);
+		table->symbols = realloc(table->symbols,
+			table->capacity * sizeof(*table->symbols));
+		if (!table->symbols) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
 	}
+
+	u32 id = table->count++;
+	struct qm_symbol *symbol = &table->symbols[id];
+	symbol->name = arena_alloc(&table->arena, length + 1, u8);
+	symbol->length = length;
+	symbol->hash = h;
+	symbol->flags = 0;
+	memcpy(symbol->name, name, length);
+	symbol->name[length] = '\0';
+
+	table->slots[i] = id;
+	return id;
+}
+
+static u8 *
+symbol_name(u32 id)
+{
+	assert(id < symbols.count);
+	return id ? symbols.symbols[id].name : (u8 *)"";
 }
 
 static u32
-hash(const u8 *op)
+symbol_length(u32 id)
 {
-	u32 h = 5381;
+	assert(0 < id && id < symbols.count);
+	return symbols.symbols[id].length;
+}
+
+static u32
+symbol_hash(u32 id)
+{
+	assert(0 < id && id < symbols.count);
+	return symbols.symbols[id].hash;
+}
+
+static u32
+symbol_flags(u32 id)
+{
+	assert(0 < id && id < symbols.count);
+	return symbols.symbols[id].flags;
+}
+
+static u32
+symbol_version(u32 id)
+{
+	assert(0 < id && id < symbols.count);
+	return symbols.symbols[id].version;
+}
+
+static void
+symbol_touch(u32 id)
+{
+	assert(0 < id && id < symbols.count);
+	symbols.symbols[id].version++;
+}
+
+static void
+symbol_set_flags(u32 id, u32 flags)
+{
+	assert(0 < id && id < symbols.count);
+	if ((symbols.symbols[id].flags & flags) != flags) {
+		symbols.symbols[id].flags |= flags;
+		symbols.symbols[id].version++;
+	}
+}
+
+static void
+symbols_init(void)
+{
+	static const char *builtins[QM_SYMBOL_COUNT] = {
+		[QM_SYMBOL_UNWRAP] = "__unwrap__",
+		[QM_SYMBOL_EQUALS] = "=",
+	};
+
+	for (u32 id = 1; id < QM_SYMBOL_COUNT; id++) {
+		const u8 *name = (const u8 *)builtins[id];
+		u32 result = symbol_intern(name, string_length(name));
+		assert(result == id);
+		(void)result;
+	}
+}
+
+static void
+symbols_finish(void)
+{
+	arena_finish(&symbols.arena);
+	free(symbols.symbols);
+	free(symbols.slots);
+	memset(&symbols, 0, sizeof(symbols));
+}
+
+/*
+ * Copies the flags and versions of the symbols, so that the changes of a
+ * document can be undone with symbols_restore, which also removes the
+ * symbols that were interned since.
+ */
+static struct qm_symbol_snapshot
+symbols_save(void)
+{
+	struct qm_symbol_snapshot snapshot;
+	snapshot.count = symbols.count;
+	snapshot.temp = arena_begin_temp(&symbols.arena);
+	snapshot.symbols = malloc(MAX(symbols.count, 1) * sizeof(*snapshot.symbols));
+	if (!snapshot.symbols) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
 
-	if (op) {
-		while (*op) {
-			h = (h << 5) + h + *op++;
+	memcpy(snapshot.symbols, symbols.symbols,
+		symbols.count * sizeof(*snapshot.symbols));
+	return snapshot;
+}
+
+static void
+symbols_restore(struct qm_symbol_snapshot *snapshot)
+{
+	assert(snapshot->count <= symbols.count);
+	memcpy(symbols.symbols, snapshot->symbols,
+		snapshot->count * sizeof(*snapshot->symbols));
+
+	/*
+	 * NOTE: the newer symbols were inserted after the older ones, also when
+	 * the slots grew, so they are never part of the probe sequence of an
+	 * older symbol and their slots can simply be emptied.
+	 */
+	if (symbols.count > snapshot->count) {
+		for (u32 i = 0; i < symbols.slot_count; i++) {
+			if (symbols.slots[i] >= snapshot->count) {
+				symbols.slots[i] = 0;
+			}
 		}
+
+		symbols.count = snapshot->count;
 	}
 
-	return h;
+	arena_end_temp(snapshot->temp);
+	free(snapshot->symbols);
 }
 
-#include "debug.c"
 #include "tex.c"
+#include "memo.c"
+#include "bytecode.c"
 #include "pandoc.c"
+#include "image.c"
 
 static bool
 file_read(const char *filename, struct qm_memory_arena *arena,
@@ -134,13 +604,13 @@ file_read(const char *filename, struct qm_memory_arena *arena,
 		return false;
 	}
 
-	u32 size = 2 * BUFSIZ;
+	usize size = 2 * BUFSIZ;
 	u8 *data = calloc(size, 1);
 	if (!data) {
 		return false;
 	}
 
-	u32 n, length = 0;
+	usize n, length = 0;
 	while ((n = fread(data + length, 1, BUFSIZ, f))) {
 		length += n;
 		if (length + BUFSIZ + 1 >= size) {
@@ -160,284 +630,533 @@ file_read(const char *filename, struct qm_memory_arena *arena,
 	return true;
 }
 
+/*
+ * Maps a regular file, so it can be read in place instead of being copied.
+ * Writes to a writable mapping are private. Returns false if the file can't
+ * be mapped, e.g. for pipes, and the caller has to read it instead.
+ */
 static bool
-operator_define(struct qm_operator_table *operators,
-		struct qm_memory_arena *arena, u8 *op, i32 lbp, i32 rbp)
+file_map(const char *filename, struct qm_buffer *buffer, bool is_writable)
 {
-	assert(op);
-
-	if (!operators->keys) {
-		operators->used = 0;
-		operators->size = 1024;
-		operators->keys = arena_alloc(arena, operators->size, u8 *);
-		operators->lbp  = arena_alloc(arena, operators->size, i32);
-		operators->rbp  = arena_alloc(arena, operators->size, i32);
+#if QM_FILE_MMAP
+	int fd = filename ? open(filename, O_RDONLY) : STDIN_FILENO;
+	if (fd < 0) {
+		return false;
 	}
 
-	u8 **keys = operators->keys;
-	i32 *lbps = operators->lbp;
-	i32 *rbps = operators->rbp;
-	u32 size = operators->size;
-	u32 mask = size - 1;
-
-	u32 i = hash(op) & mask;
-	while (size-- > 0) {
-		if (!keys[i]) {
-			keys[i] = op;
-			lbps[i] = lbp;
-			rbps[i] = rbp;
-			return true;
-		} else if (string_equals(keys[i], op)) {
-			// NOTE: operator was redefined.
-			return false;
+	bool is_mapped = false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		int protection = is_writable ? PROT_READ | PROT_WRITE : PROT_READ;
+		int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+		/* NOTE: writable mappings are copied in bulk instead of per fault. */
+		if (is_writable) {
+			flags |= MAP_POPULATE;
 		}
+#endif
+
+		void *data = mmap(0, st.st_size, protection, flags, fd, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			buffer->data = data;
+			buffer->size = st.st_size;
+			buffer->start = 0;
+			buffer->is_mapped = true;
+			is_mapped = true;
+		}
+	}
 
-		i = (i + 1) & mask;
+	if (filename) {
+		close(fd);
 	}
 
+	return is_mapped;
+#else
+	(void)filename;
+	(void)buffer;
+	(void)is_writable;
 	return false;
+#endif
 }
 
-static bool
-operator_find(struct qm_operator_table *operators, u8 *op,
-		i32 *lbp, i32 *rbp)
+static void
+file_close(struct qm_buffer *buffer)
 {
-	u8 **keys = operators->keys;
-	i32 *lbps = operators->lbp;
-	i32 *rbps = operators->rbp;
-	u32 size = operators->size;
-	u32 mask = size - 1;
-
-	assert(op);
-	u32 i = hash(op) & mask;
-	while (size-- > 0) {
-		if (string_equals(keys[i], op)) {
-			*lbp = lbps[i];
-			*rbp = rbps[i];
-			return true;
-		}
-
-		i = (i + 1) & mask;
+#if QM_FILE_MMAP
+	if (buffer->is_mapped) {
+		munmap(buffer->data, buffer->size);
+		return;
 	}
+#endif
 
-	return false;
+	free(buffer->data);
 }
 
-static bool
-operator_find_prefix(struct qm_operator_table *operators, u8 *op, i32 *rbp)
-{
-	i32 tmp = 0;
-
-	if (operator_find(operators, op, &tmp, rbp)) {
-		return tmp == 0;
-	} else {
-		return false;
-	}
-}
+#include "cache.c"
 
-static bool
-operator_find_infix(struct qm_operator_table *operators, u8 *op,
-		i32 *lbp, i32 *rbp)
+static void
+operator_table_grow(struct qm_operator_table *operators,
+		struct qm_memory_arena *arena)
 {
-	if (operator_find(operators, op, lbp, rbp)) {
-		return *lbp != 0 && *rbp != 0;
-	} else {
-		return false;
-	}
-}
+	u32 old_size = operators->size;
+	u32 *old_keys = operators->keys;
+	u32 *old_hashes = operators->hashes;
+	struct qm_operator *old_values = operators->values;
 
-static bool
-operator_find_postfix(struct qm_operator_table *operators, u8 *op, i32 *lbp)
-{
-	i32 tmp = 0;
+	u32 size = MAX(2 * old_size, 64);
+	u32 mask = size - 1;
+	operators->size = size;
+	operators->keys = arena_alloc_zero(arena, size, u32);
+	operators->hashes = arena_alloc(arena, size, u32);
+	operators->values = arena_alloc(arena, size, struct qm_operator);
+
+	for (u32 j = 0; j < old_size; j++) {
+		if (old_keys[j]) {
+			u32 i = old_hashes[j] & mask;
+			while (operators->keys[i]) {
+				i = (i + 1) & mask;
+			}
 
-	if (operator_find(operators, op, lbp, &tmp)) {
-		return tmp == 0;
-	} else {
-		return false;
+			operators->keys[i] = old_keys[j];
+			operators->hashes[i] = old_hashes[j];
+			operators->values[i] = old_values[j];
+		}
 	}
 }
 
-static bool
-is_digit(u8 c)
-{
-	return '0' <= c && c <= '9';
-}
-
-static bool
-is_alpha(u8 c)
+/* Clones the entries of the table, see operator_table_restore. */
+static struct qm_operator_table
+operator_table_save(struct qm_operator_table *operators)
 {
-	return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
-}
+	struct qm_operator_table saved = *operators;
+	saved.keys = malloc(operators->size * sizeof(*saved.keys));
+	saved.hashes = malloc(operators->size * sizeof(*saved.hashes));
+	saved.values = malloc(operators->size * sizeof(*saved.values));
+	if (!saved.keys || !saved.hashes || !saved.values) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
 
-static bool
-is_whitespace(u8 c)
-{
-	return c == ' ' || c == '\t';
+	memcpy(saved.keys, operators->keys, operators->size * sizeof(*saved.keys));
+	memcpy(saved.hashes, operators->hashes,
+		operators->size * sizeof(*saved.hashes));
+	memcpy(saved.values, operators->values,
+		operators->size * sizeof(*saved.values));
+	return saved;
 }
 
-static bool
-is_separator(u8 c)
+/*
+ * Puts the saved entries back into the arrays of the original table. The
+ * arrays of a table which grew since then were freed with their arena.
+ */
+static void
+operator_table_restore(struct qm_operator_table *operators,
+		struct qm_operator_table *original, struct qm_operator_table *saved)
 {
-    switch (c) {
-	case '(': case '[': case '{':
-	case ')': case ']': case '}':
-	case ',': case '\n': case '"': case '`':
-    case ' ': case '\t':
-        return true;
-    default:
-        return false;
-    }
+#if QM_STATS
+	struct qm_probe_stats probes = operators->probes;
+#endif
+
+	*operators = *original;
+	memcpy(operators->keys, saved->keys, saved->size * sizeof(*saved->keys));
+	memcpy(operators->hashes, saved->hashes,
+		saved->size * sizeof(*saved->hashes));
+	memcpy(operators->values, saved->values,
+		saved->size * sizeof(*saved->values));
+#if QM_STATS
+	operators->probes = probes;
+#endif
+
+	free(saved->keys);
+	free(saved->hashes);
+	free(saved->values);
 }
 
+/*
+ * Returns the slot of the operator or the empty slot where it would have to be
+ * inserted. The table is never full, so the probe always terminates.
+ */
 static u32
-token_length(struct qm_token *token, struct qm_buffer *buffer)
+operator_slot(struct qm_operator_table *operators, u32 op, u32 h)
 {
-	u8 *at = buffer->data + token->start;
-	u32 length = 0;
-
-	switch (token->type) {
-	case QM_TOKEN_STRING:
-		assert(*at == '"');
-
-		do {
-			length++;
-			at++;
-		} while (*at && *at != '"');
-		length++;
-		break;
-	case QM_TOKEN_RAW_STRING:
-		assert(*at == '`');
+	u32 *keys = operators->keys;
+	u32 mask = operators->size - 1;
 
-		do {
-			length++;
-			at++;
-		} while (*at && *at != '`');
-		length++;
-		break;
-	case QM_TOKEN_IDENTIFIER:
-		if (is_alpha(*at) || *at == '_') {
-			do {
-				length++;
-				at++;
-			} while (*at && (is_digit(*at) || is_alpha(*at) || *at == '_'));
-		} else {
-			do {
-				length++;
-				at++;
-			} while (*at && !is_digit(*at) && !is_alpha(*at) && !is_separator(*at));
-		}
-		break;
-	case QM_TOKEN_NUMBER:
-		do {
-			at++;
-			length++;
-		} while (*at && is_digit(*at));
-		break;
-	case QM_TOKEN_LPAREN:
-	case QM_TOKEN_RPAREN:
-	case QM_TOKEN_LBRACKET:
-	case QM_TOKEN_RBRACKET:
-	case QM_TOKEN_LBRACE:
-	case QM_TOKEN_RBRACE:
-	case QM_TOKEN_COMMA:
-	case QM_TOKEN_NEWLINE:
-		length = 1;
-		break;
+	u32 i = h & mask;
+	while (keys[i] && keys[i] != op) {
+		i = (i + 1) & mask;
 	}
 
-	return length;
+	return i;
 }
 
+/*
+ * The fixity follows from the binding powers: an operator without a left
+ * binding power is a prefix operator, one without a right binding power is a
+ * postfix operator. A symbol can be defined once for each fixity.
+ */
 static bool
-tokenize(struct qm_buffer *buffer, struct qm_token *token)
+operator_define(struct qm_operator_table *operators,
+		struct qm_memory_arena *arena, u32 op, i32 lbp, i32 rbp)
 {
-	u8 *at = buffer->data + buffer->start;
-	while (is_whitespace(*at)) {
-		at++;
+	assert(op);
+
+	if (2 * (operators->used + 1) > operators->size) {
+		operator_table_grow(operators, arena);
+	}
+
+	u32 h = symbol_hash(op);
+	u32 i = operator_slot(operators, op, h);
+	struct qm_operator *operator = &operators->values[i];
+	if (!operators->keys[i]) {
+		operators->keys[i] = op;
+		operators->hashes[i] = h;
+		operators->used++;
+		memset(operator, 0, sizeof(*operator));
+	}
+
+	u32 fixity = QM_FIXITY_INFIX;
+	if (lbp == 0) {
+		fixity = QM_FIXITY_PREFIX;
+	} else if (rbp == 0) {
+		fixity = QM_FIXITY_POSTFIX;
 	}
 
-	buffer->start = token->start = at - buffer->data;
-	if (token->start == buffer->size) {
-		token->type = QM_TOKEN_EOF;
+	if (operator->fixity & fixity) {
+		// NOTE: operator was redefined.
 		return false;
 	}
 
-	token->type = QM_TOKEN_INVALID;
-	switch (*at) {
-	case '(':  token->type = QM_TOKEN_LPAREN;     break;
-	case '[':  token->type = QM_TOKEN_LBRACKET;   break;
-	case '{':  token->type = QM_TOKEN_LBRACE;     break;
-	case ')':  token->type = QM_TOKEN_RPAREN;     break;
-	case ']':  token->type = QM_TOKEN_RBRACKET;   break;
-	case '}':  token->type = QM_TOKEN_RBRACE;     break;
-	case ',':  token->type = QM_TOKEN_COMMA;      break;
-	case '\n': token->type = QM_TOKEN_NEWLINE;    break;
-	case '\0': token->type = QM_TOKEN_EOF;        break;
-	case '"':  token->type = QM_TOKEN_STRING;     break;
-	case '`':  token->type = QM_TOKEN_RAW_STRING; break;
-
-	case '0': case '1': case '2': case '3': case '4':
-	case '5': case '6': case '7': case '8': case '9':
-		token->type = QM_TOKEN_NUMBER;
+	operator->fixity |= fixity;
+	switch (fixity) {
+	case QM_FIXITY_PREFIX:
+		operator->prefix_rbp = rbp;
 		break;
-	default:
-		token->type = QM_TOKEN_IDENTIFIER;
+	case QM_FIXITY_INFIX:
+		operator->infix_lbp = lbp;
+		operator->infix_rbp = rbp;
+		break;
+	case QM_FIXITY_POSTFIX:
+		operator->postfix_lbp = lbp;
 		break;
 	}
 
-	u32 length = token_length(token, buffer);
-    if (length == 2) {
-        if (memcmp(at, "op", 2) == 0) {
-            token->type = QM_TOKEN_OP;
-        } else if (memcmp(at, "fn", 2) == 0) {
-            token->type = QM_TOKEN_FN;
-        }
-    } else if (length == 3) {
-        if (memcmp(at, "var", 3) == 0) {
-            token->type = QM_TOKEN_VAR;
-        } else if (memcmp(at, "opr", 3) == 0) {
-            token->type = QM_TOKEN_OPR;
-        } else if (memcmp(at, "opp", 3) == 0) {
-            token->type = QM_TOKEN_OPP;
-        }
-    }
-
-	buffer->start += length;
 	return true;
 }
 
-static void
-parser_location(struct qm_parser *parser, u32 *out_line, u32 *out_column)
+static struct qm_operator *
+operator_find(struct qm_operator_table *operators, u32 op)
 {
-	u8 *at = parser->buffer.data;
-	u32 count = parser->buffer.start;
+	assert(op);
 
-	u32 line = 1;
-	u32 column = 1;
-	while (count-- > 0) {
-		column++;
+	if (operators->size == 0) {
+		return 0;
+	}
+
+	u32 h = symbol_hash(op);
+	u32 i = operator_slot(operators, op, h);
+	stats_probe(&operators->probes, (i - h) & (operators->size - 1));
+	return operators->keys[i] ? &operators->values[i] : 0;
+}
+
+enum qm_char_class {
+	QM_CHAR_NUL        = 0,
+	QM_CHAR_WHITESPACE = 1 << 0,
+	QM_CHAR_ALPHA      = 1 << 1,
+	QM_CHAR_DIGIT      = 1 << 2,
+	QM_CHAR_UNDERSCORE = 1 << 3,
+	QM_CHAR_SEPARATOR  = 1 << 4,
+	QM_CHAR_SYMBOL     = 1 << 5,
+
+	QM_CHAR_WORD = QM_CHAR_ALPHA | QM_CHAR_DIGIT | QM_CHAR_UNDERSCORE,
+	QM_CHAR_OPERATOR = QM_CHAR_SYMBOL | QM_CHAR_UNDERSCORE,
+};
+
+static u8 char_class[256];
+
+static void
+char_class_init(void)
+{
+	for (u32 c = 1; c < 256; c++) {
+		char_class[c] = QM_CHAR_SYMBOL;
+	}
+
+	for (u32 c = 'a'; c <= 'z'; c++) {
+		char_class[c] = QM_CHAR_ALPHA;
+		char_class[c - 'a' + 'A'] = QM_CHAR_ALPHA;
+	}
+
+	for (u32 c = '0'; c <= '9'; c++) {
+		char_class[c] = QM_CHAR_DIGIT;
+	}
+
+	const u8 *separators = (const u8 *)"()[]{},\n\"`";
+	while (*separators) {
+		char_class[*separators++] = QM_CHAR_SEPARATOR;
+	}
 
-		if (*at == '\n') {
-			line++;
-			column = 1;
+	char_class['\0'] = QM_CHAR_NUL;
+	char_class['_']  = QM_CHAR_UNDERSCORE;
+	char_class[' ']  = QM_CHAR_WHITESPACE;
+	char_class['\t'] = QM_CHAR_WHITESPACE;
+}
+
+/*
+ * Vectorized classification of runs of characters. Each function returns a
+ * bitmask with one bit per byte of the vector, which is set if the byte
+ * belongs to the given class. The scalar loop in lex_skip handles the tail
+ * of the buffer and targets without SSE2.
+ */
+
+#ifdef QM_SIMD_WIDTH
+static qm_simd
+simd_in_range(qm_simd v, u8 lo, u8 hi)
+{
+	/* NOTE: unsigned comparison through signed compares with a bias. */
+	qm_simd x = simd_xor(simd_sub(v, simd_set1(lo)), simd_set1(0x80));
+	return simd_gt(simd_set1(hi - lo + 1 - 128), x);
+}
+
+static u32
+simd_classify(const u8 *at, u32 class)
+{
+	qm_simd v = simd_load(at);
+	qm_simd alpha = simd_in_range(simd_or(v, simd_set1(0x20)), 'a', 'z');
+	qm_simd digit = simd_in_range(v, '0', '9');
+	qm_simd underscore = simd_eq(v, simd_set1('_'));
+	qm_simd whitespace = simd_or(simd_eq(v, simd_set1(' ')),
+		simd_eq(v, simd_set1('\t')));
+
+	switch (class) {
+	case QM_CHAR_WHITESPACE:
+		return simd_movemask(whitespace);
+	case QM_CHAR_DIGIT:
+		return simd_movemask(digit);
+	case QM_CHAR_WORD:
+		return simd_movemask(simd_or(simd_or(alpha, digit), underscore));
+	case QM_CHAR_OPERATOR:
+		{
+			qm_simd other = simd_or(simd_or(alpha, digit), whitespace);
+			other = simd_or(other, simd_eq(v, simd_set1('\0')));
+			other = simd_or(other, simd_eq(v, simd_set1('(')));
+			other = simd_or(other, simd_eq(v, simd_set1(')')));
+			other = simd_or(other, simd_eq(v, simd_set1(',')));
+			other = simd_or(other, simd_eq(v, simd_set1('\n')));
+			other = simd_or(other, simd_eq(v, simd_set1('"')));
+			other = simd_or(other, simd_eq(v, simd_set1('`')));
+			other = simd_or(other, simd_eq(v, simd_set1('[')));
+			other = simd_or(other, simd_eq(v, simd_set1(']')));
+			other = simd_or(other, simd_eq(v, simd_set1('{')));
+			other = simd_or(other, simd_eq(v, simd_set1('}')));
+			return ~simd_movemask(other);
 		}
+	default:
+		assert(!"Invalid character class");
+		return 0;
+	}
+}
+#endif
+
+/* Returns the first byte in [at, end) which is not part of the class. */
+static const u8 *
+lex_skip(const u8 *at, const u8 *end, u32 class)
+{
+#ifdef QM_SIMD_WIDTH
+	while (end - at >= QM_SIMD_WIDTH) {
+		u32 mask = simd_classify(at, class);
+		u32 full = (u32)((1ull << QM_SIMD_WIDTH) - 1);
+		if ((mask & full) != full) {
+			return at + __builtin_ctz(~mask);
+		}
+
+		at += QM_SIMD_WIDTH;
+	}
+#endif
 
+	while (at < end && (char_class[*at] & class)) {
 		at++;
 	}
 
-	*out_line = line;
-	*out_column = column;
+	return at;
+}
+
+static void
+lex(struct qm_parser *parser)
+{
+	const u8 *start = parser->buffer.data;
+	const u8 *end = start + parser->buffer.size;
+	const u8 *at = start;
+
+	u32 count = 0;
+	for (;;) {
+		if (count == parser->token_capacity) {
+			parser->token_capacity = MAX(2 * parser->token_capacity, 4096);
+			parser->tokens = realloc(parser->tokens,
+				parser->token_capacity * sizeof(*parser->tokens));
+			if (!parser->tokens) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		at = lex_skip(at, end, QM_CHAR_WHITESPACE);
+
+		struct qm_token *token = &parser->tokens[count++];
+		token->start = at - start;
+		token->length = 1;
+		token->symbol = 0;
+		if (at == end || *at == '\0') {
+			token->type = QM_TOKEN_EOF;
+			token->length = 0;
+			break;
+		}
+
+		const u8 *token_end = at + 1;
+		switch (*at) {
+		case '(':  token->type = QM_TOKEN_LPAREN;     break;
+		case '[':  token->type = QM_TOKEN_LBRACKET;   break;
+		case '{':  token->type = QM_TOKEN_LBRACE;     break;
+		case ')':  token->type = QM_TOKEN_RPAREN;     break;
+		case ']':  token->type = QM_TOKEN_RBRACKET;   break;
+		case '}':  token->type = QM_TOKEN_RBRACE;     break;
+		case ',':  token->type = QM_TOKEN_COMMA;      break;
+		case '\n': token->type = QM_TOKEN_NEWLINE;    break;
+		case '"':
+		case '`':
+			token->type = *at == '"' ? QM_TOKEN_STRING : QM_TOKEN_RAW_STRING;
+			token_end = memchr(at + 1, *at, end - (at + 1));
+			if (token_end) {
+				token_end++;
+			} else {
+				token->type = QM_TOKEN_INVALID;
+				token_end = end;
+			}
+			break;
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9':
+			token->type = QM_TOKEN_NUMBER;
+			token_end = lex_skip(at + 1, end, QM_CHAR_DIGIT);
+			break;
+		default:
+			token->type = QM_TOKEN_IDENTIFIER;
+			if (char_class[*at] & (QM_CHAR_ALPHA | QM_CHAR_UNDERSCORE)) {
+				token_end = lex_skip(at + 1, end, QM_CHAR_WORD);
+			} else {
+				token_end = lex_skip(at + 1, end, QM_CHAR_OPERATOR);
+			}
+			break;
+		}
+
+		u32 length = token->length = token_end - at;
+		if (token->type != QM_TOKEN_IDENTIFIER) {
+			/* NOTE: only identifiers can be keywords. */
+		} else if (length == 2) {
+			if (memcmp(at, "op", 2) == 0) {
+				token->type = QM_TOKEN_OP;
+			} else if (memcmp(at, "fn", 2) == 0) {
+				token->type = QM_TOKEN_FN;
+			}
+		} else if (length == 3) {
+			if (memcmp(at, "var", 3) == 0) {
+				token->type = QM_TOKEN_VAR;
+			} else if (memcmp(at, "opr", 3) == 0) {
+				token->type = QM_TOKEN_OPR;
+			} else if (memcmp(at, "opp", 3) == 0) {
+				token->type = QM_TOKEN_OPP;
+			}
+		}
+
+		if (token->type == QM_TOKEN_IDENTIFIER) {
+			token->symbol = symbol_intern(at, length);
+		}
+
+		at = token_end;
+	}
+
+	parser->token_count = count;
+	parser->token_index = 0;
+	parser->token = parser->tokens[0];
+	parser->line_count = 0;
+}
+
+static void
+parser_advance(struct qm_parser *parser)
+{
+	if (parser->token_index + 1 < parser->token_count) {
+		parser->token = parser->tokens[++parser->token_index];
+	}
+}
+
+static void
+parser_location(struct qm_parser *parser, u32 *out_line, u32 *out_column)
+{
+	u8 *data = parser->buffer.data;
+	usize size = parser->buffer.size;
+	u32 offset = parser->token.start + parser->token.length;
+
+	if (parser->line_count == 0) {
+		u32 count = 1;
+		u8 *at = data;
+		while ((at = memchr(at, '\n', size - (at - data)))) {
+			at++;
+			count++;
+		}
+
+		if (count > parser->line_capacity) {
+			parser->line_capacity = MAX(count, 2 * parser->line_capacity);
+			parser->lines = realloc(parser->lines,
+				parser->line_capacity * sizeof(*parser->lines));
+			if (!parser->lines) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		at = data;
+		parser->lines[0] = 0;
+		for (u32 i = 1; i < count; i++) {
+			at = (u8 *)memchr(at, '\n', size - (at - data)) + 1;
+			parser->lines[i] = at - data;
+		}
+
+		parser->line_count = count;
+	}
+
+	/* NOTE: find the last line which starts at or before the offset. */
+	u32 lo = 0;
+	u32 hi = parser->line_count;
+	while (hi - lo > 1) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (parser->lines[mid] <= offset) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	*out_line = lo + 1;
+	*out_column = offset - parser->lines[lo] + 1;
 }
 
+/*
+ * Only the first error of a statement is reported, since the parser is out of
+ * sync afterwards. parse_statement resynchronizes at the next newline.
+ */
 static void
 parser_error(struct qm_parser *parser, const char *fmt, ...)
 {
+	if (parser->result != QM_OK) {
+		return;
+	}
+
 	parser->result = QM_ERR_INVALID_TOKEN;
+	parser->error_token = parser->token_index;
+	parser->error_count++;
 
 	u32 line, column;
 	parser_location(parser, &line, &column);
-	fprintf(stderr, "error:%d:%d: ", line, column);
+	fprintf(stderr, "error:%s:%d:%d: ", parser->name, line, column);
 
 	va_list ap;
 	va_start(ap, fmt);
@@ -448,16 +1167,45 @@ parser_error(struct qm_parser *parser, const char *fmt, ...)
 	fflush(stderr);
 }
 
-static bool
-accept(struct qm_parser *parser, enum qm_token_type type)
+/*
+ * Reports a statement which failed at runtime, at its first token. The
+ * source is searched for the line, since this only happens on errors.
+ */
+static void
+eval_error(const char *name, const u8 *source, u32 offset, const char *error)
+{
+	u32 line = 1;
+	const u8 *line_start = source;
+	const u8 *at;
+	while ((at = memchr(line_start, '\n', source + offset - line_start))) {
+		line_start = at + 1;
+		line++;
+	}
+
+	fprintf(stderr, "error:%s:%u:%u: %s\n", name, line,
+		(u32)(source + offset - line_start) + 1, error);
+	fflush(stderr);
+}
+
+static void
+parser_recover(struct qm_parser *parser)
 {
-	if (!parser->is_initialized) {
-		tokenize(&parser->buffer, &parser->token);
-		parser->is_initialized = true;
+	parser->token_index = parser->error_token;
+	parser->token = parser->tokens[parser->token_index];
+	while (parser->token.type != QM_TOKEN_NEWLINE &&
+			parser->token.type != QM_TOKEN_EOF) {
+		parser_advance(parser);
 	}
 
+	parser_advance(parser);
+	parser->result = QM_OK;
+}
+
+static bool
+accept_token(struct qm_parser *parser, enum qm_token_type type)
+{
 	if (parser->result != 0 || parser->token.type == type) {
-		tokenize(&parser->buffer, &parser->token);
+		parser_advance(parser);
 		return true;
 	} else {
 		return false;
@@ -465,17 +1213,12 @@ accept(struct qm_parser *parser, enum qm_token_type type)
 }
 
 static bool
-accept_identifier(struct qm_parser *parser, u8 *expected)
+accept_identifier(struct qm_parser *parser, u32 expected)
 {
-	if (parser->token.type == QM_TOKEN_IDENTIFIER) {
-		u32 expected_length = string_length(expected);
-		u32 found_length = token_length(&parser->token, &parser->buffer);
-		u8 *found = parser->buffer.data + parser->token.start;
-		if (expected_length == found_length &&
-				memcmp(expected, found, found_length) == 0) {
-			 accept(parser, QM_TOKEN_IDENTIFIER);
-			 return true;
-		}
+	if (parser->token.type == QM_TOKEN_IDENTIFIER &&
+			parser->token.symbol == expected) {
+		 accept_token(parser, QM_TOKEN_IDENTIFIER);
+		 return true;
 	}
 
 	return false;
@@ -484,37 +1227,28 @@ accept_identifier(struct qm_parser *parser, u8 *expected)
 static void
 expect(struct qm_parser *parser, enum qm_token_type type)
 {
-	if (!accept(parser, type)) {
+	if (!accept_token(parser, type)) {
 		parser_error(parser, "Expected %s, but found %s",
 			token_name[type], token_name[parser->token.type]);
 	}
 }
 
 static void
-expect_identifier(struct qm_parser *parser, u8 *expected)
+expect_identifier(struct qm_parser *parser, u32 expected)
 {
 	if (!accept_identifier(parser, expected)) {
-		parser_error(parser, "Expected '%s'", expected);
+		parser_error(parser, "Expected '%s'", symbol_name(expected));
 	}
 }
 
 static bool
-peek_identifier(struct qm_parser *parser, struct qm_memory_arena *arena,
-		u8 **identifier)
+peek_identifier(struct qm_parser *parser, u32 *identifier)
 {
 	bool result = false;
 
 	if (parser->token.type == QM_TOKEN_IDENTIFIER) {
 		result = true;
-
-		u32 length = token_length(&parser->token, &parser->buffer);
-		u8 *at = parser->buffer.data + parser->token.start;
-		u8 *tmp = arena_alloc(arena, length + 1, u8);
-		*identifier = tmp;
-
-		while (length-- > 0) {
-			*tmp++ = *at++;
-		}
+		*identifier = parser->token.symbol;
 	}
 
 	return result;
@@ -530,6 +1264,22 @@ parse_expression(struct qm_parser *parser, struct qm_memory_arena *arena,
 	return parse_expression_(parser, arena, expression, 0);
 }
 
+static void
+scratch_push(struct qm_parser *parser, struct qm_expression *expr)
+{
+	if (parser->scratch_used == parser->scratch_capacity) {
+		parser->scratch_capacity = MAX(2 * parser->scratch_capacity, 64);
+		parser->scratch = realloc(parser->scratch,
+			parser->scratch_capacity * sizeof(*parser->scratch));
+		if (!parser->scratch) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	parser->scratch[parser->scratch_used++] = *expr;
+}
+
 static bool
 parse_matrix(struct qm_parser *parser, struct qm_memory_arena *arena,
 		struct qm_matrix *matrix)
@@ -537,72 +1287,64 @@ parse_matrix(struct qm_parser *parser, struct qm_memory_arena *arena,
 	bool result = false;
 
 	enum qm_token_type closing_delimiter = 0;
-	if (accept(parser, QM_TOKEN_LPAREN)) {
+	if (accept_token(parser, QM_TOKEN_LPAREN)) {
 		result = true;
 		matrix->delimiter = QM_TOKEN_LPAREN;
 		closing_delimiter = QM_TOKEN_RPAREN;
-	} else if (accept(parser, QM_TOKEN_LBRACKET)) {
+	} else if (accept_token(parser, QM_TOKEN_LBRACKET)) {
 		result = true;
 		matrix->delimiter = QM_TOKEN_LBRACKET;
 		closing_delimiter = QM_TOKEN_RBRACKET;
-	} else if (accept(parser, QM_TOKEN_LBRACE)) {
+	} else if (accept_token(parser, QM_TOKEN_LBRACE)) {
 		result = true;
 		matrix->delimiter = QM_TOKEN_LBRACKET;
 		closing_delimiter = QM_TOKEN_RBRACE;
 	}
 
 	if (result) {
-		struct qm_memory_block *block = memory_block_create(0);
-		struct qm_expression *expr = block->data;
+		/*
+		 * NOTE: the cells are collected on the scratch stack of the parser
+		 * and copied into the arena once the matrix is complete. Nested
+		 * matrices push their cells above ours and pop them again before we
+		 * continue.
+		 */
+		u32 base = parser->scratch_used;
 		matrix->width = 0;
 		matrix->height = 1;
 
-		u32 i = 0;
 		while (parser->result == 0) {
-			if (block->used + sizeof(*expr) >= block->size) {
-				block->size *= 2;
-				assert(block->size);
-				if (!(block = realloc(block, block->size + sizeof(*block)))) {
-					perror("realloc");
-					exit(EXIT_FAILURE);
-				}
-
-				block->data = block + 1;
-				expr = block->data;
-				usize remaining = block->size - block->used;
-				memset((u8 *)block->data + block->used, 0, remaining);
-			}
-
-			if (!parse_expression(parser, arena, &expr[i++])) {
+			struct qm_expression expr = {0};
+			if (!parse_expression(parser, arena, &expr)) {
 				parser_error(parser, "Expected expression inside matrix");
 				break;
 			}
 
-			block->used += sizeof(*expr);
+			scratch_push(parser, &expr);
 
 			matrix->width++;
-			if (!accept(parser, QM_TOKEN_COMMA)) {
+			if (!accept_token(parser, QM_TOKEN_COMMA)) {
 				break;
 			}
 		}
 
 		expect(parser, closing_delimiter);
 
-		matrix->expressions = block->data;
-		block->prev = arena->block;
-		arena->block = block;
+		u32 count = parser->scratch_used - base;
+		matrix->expressions = arena_alloc(arena, count, struct qm_expression);
+		memcpy(matrix->expressions, parser->scratch + base,
+			count * sizeof(*matrix->expressions));
+		parser->scratch_used = base;
 	}
 
 	return result;
 }
 
 static bool
-parse_identifier(struct qm_parser *parser, struct qm_memory_arena *arena,
-		u8 **identifier)
+parse_identifier(struct qm_parser *parser, u32 *identifier)
 {
-	bool result = peek_identifier(parser, arena, identifier);
+	bool result = peek_identifier(parser, identifier);
 	if (result) {
-		accept(parser, QM_TOKEN_IDENTIFIER);
+		accept_token(parser, QM_TOKEN_IDENTIFIER);
 	}
 
 	return result;
@@ -617,61 +1359,34 @@ parse_number(struct qm_parser *parser, i32 *out_number)
 		result = true;
 
 		u8 *at = parser->buffer.data + parser->token.start;
+		u32 length = parser->token.length;
 		i32 number = 0;
-		while (is_digit(*at)) {
+		while (length-- > 0) {
 			number *= 10;
 			number += *at++ - '0';
 		}
 
 		*out_number = number;
-		accept(parser, QM_TOKEN_NUMBER);
-	}
-
-	return result;
-}
-
-static bool
-parse_string(struct qm_parser *parser, struct qm_memory_arena *arena,
-		u8 **string)
-{
-	bool result = false;
-
-	if (parser->token.type == QM_TOKEN_STRING) {
-		result = true;
-		u32 length = token_length(&parser->token, &parser->buffer);
-		u8 *at = parser->buffer.data + parser->token.start;
-		u8 *tmp = arena_alloc(arena, length + 1, u8);
-		*string = tmp;
-
-		while (length-- > 0) {
-			*tmp++ = *at++;
-		}
-
-		accept(parser, QM_TOKEN_STRING);
+		accept_token(parser, QM_TOKEN_NUMBER);
 	}
 
 	return result;
 }
 
 static bool
-parse_raw_string(struct qm_parser *parser, struct qm_memory_arena *arena,
-		u8 **string)
+parse_string(struct qm_parser *parser, enum qm_token_type type,
+		struct qm_string *string)
 {
 	bool result = false;
 
-	if (parser->token.type == QM_TOKEN_RAW_STRING) {
+	if (parser->token.type == type) {
 		result = true;
 
-		u32 length = token_length(&parser->token, &parser->buffer);
-		u8 *at = parser->buffer.data + parser->token.start;
-		u8 *tmp = arena_alloc(arena, length + 1, u8);
-		*string = tmp;
-
-		while (length-- > 0) {
-			*tmp++ = *at++;
-		}
-
-		accept(parser, QM_TOKEN_RAW_STRING);
+		/* NOTE: the slice excludes the surrounding quotes. */
+		assert(parser->token.length >= 2);
+		string->data = parser->buffer.data + parser->token.start + 1;
+		string->size = parser->token.length - 2;
+		accept_token(parser, type);
 	}
 
 	return result;
@@ -682,19 +1397,17 @@ parse_unary_expression(struct qm_parser *parser, struct qm_memory_arena *arena,
 		struct qm_expression *expression)
 {
 	bool result = true;
-	u8 *variable = 0;
+	u32 variable = 0;
 
 	if (parse_matrix(parser, arena, &expression->matrix)) {
 		expression->type = QM_EXPR_MATRIX;
-	} else if (parse_identifier(parser, arena, &variable)) {
+	} else if (parse_identifier(parser, &variable)) {
 		expression->type = QM_EXPR_VARIABLE;
 		expression->variable = variable;
 
-		i32 rbp = 0;
-		i32 lbp = 0;
-		bool is_operator = operator_find(&parser->operators, variable, &lbp, &rbp);
-		bool is_prefix_operator = lbp == 0 && rbp != 0;
-		if (is_operator && is_prefix_operator) {
+		struct qm_operator *operator = operator_find(&parser->operators, variable);
+		if (operator && (operator->fixity & QM_FIXITY_PREFIX)) {
+			i32 rbp = operator->prefix_rbp;
 			expression->type = QM_EXPR_CALL;
 
 			struct qm_expression *arg =
@@ -710,15 +1423,15 @@ parse_unary_expression(struct qm_parser *parser, struct qm_memory_arena *arena,
 
 			expression->call.callee = callee;
 			expression->call.arg = arg;
-        } else if (is_operator) {
+        } else if (operator) {
 			result = false;
 		}
 
 	} else if (parse_number(parser, &expression->number)) {
 		expression->type = QM_EXPR_NUMBER;
-	} else if (parse_string(parser, arena, &expression->string)) {
+	} else if (parse_string(parser, QM_TOKEN_STRING, &expression->string)) {
 		expression->type = QM_EXPR_STRING;
-	} else if (parse_raw_string(parser, arena, &expression->string)) {
+	} else if (parse_string(parser, QM_TOKEN_RAW_STRING, &expression->string)) {
 		expression->type = QM_EXPR_RAW_STRING;
 	} else {
 		result = false;
@@ -728,7 +1441,7 @@ parse_unary_expression(struct qm_parser *parser, struct qm_memory_arena *arena,
 }
 
 static struct qm_expression *
-variable_create(struct qm_memory_arena *arena, u8 *identifier)
+variable_create(struct qm_memory_arena *arena, u32 identifier)
 {
 	struct qm_expression *expr = arena_alloc(arena, 1,
 		struct qm_expression);
@@ -764,17 +1477,19 @@ parse_expression_(struct qm_parser *parser, struct qm_memory_arena *arena,
 		result = true;
 
 		while (parser->result == 0) {
-			u8 *op = 0;
-			bool is_identifier = peek_identifier(parser, arena, &op);
+			u32 op = 0;
+			struct qm_operator *operator = 0;
+			if (peek_identifier(parser, &op)) {
+				operator = operator_find(operators, op);
+			}
 
-			i32 lbp, rbp;
 			struct qm_expression rhs = {0};
-			if (is_identifier && operator_find_postfix(operators, op, &lbp)) {
-				if (lbp < bp) {
+			if (operator && (operator->fixity & QM_FIXITY_POSTFIX)) {
+				if (operator->postfix_lbp < bp) {
 					break;
 				}
 
-				accept(parser, QM_TOKEN_IDENTIFIER);
+				accept_token(parser, QM_TOKEN_IDENTIFIER);
 
 				struct qm_expression *callee = variable_create(arena, op);
 				struct qm_expression *arg = arena_alloc(arena, 1,
@@ -784,18 +1499,19 @@ parse_expression_(struct qm_parser *parser, struct qm_memory_arena *arena,
 				lhs->type = QM_EXPR_CALL;
 				lhs->call.callee = callee;
 				lhs->call.arg = arg;
-			} else if (is_identifier && operator_find_infix(operators, op, &lbp, &rbp)) {
-				if (lbp < bp) {
+			} else if (operator && (operator->fixity & QM_FIXITY_INFIX)) {
+				if (operator->infix_lbp < bp) {
 					break;
 				}
 
-				accept(parser, QM_TOKEN_IDENTIFIER);
+				accept_token(parser, QM_TOKEN_IDENTIFIER);
 
 				struct qm_expression *callee = variable_create(arena, op);
 				struct qm_expression *args = arena_alloc(arena, 2,
 					struct qm_expression);
 				memcpy(&args[0], lhs, sizeof(*args));
-				if (!parse_expression_(parser, arena, &args[1], rbp)) {
+				if (!parse_expression_(parser, arena, &args[1],
+						operator->infix_rbp)) {
 					parser_error(parser, "Expected expression after operator");
 				}
 
@@ -827,38 +1543,38 @@ parse_definition(struct qm_parser *parser, struct qm_memory_arena *arena,
 {
 	bool result = false;
 
-    if (accept(parser, QM_TOKEN_VAR)) {
+    if (accept_token(parser, QM_TOKEN_VAR)) {
 		result = true;
 
-        if (!parse_identifier(parser, arena, &definition->variable)) {
+        if (!parse_identifier(parser, &definition->variable)) {
             parser_error(parser, "Expected identifier, but found %s",
 				token_name[parser->token.type]);
         }
 
         definition->parameter_count = 0;
         definition->parameters = 0;
-        expect_identifier(parser, (u8 *)"=");
+        expect_identifier(parser, QM_SYMBOL_EQUALS);
 
         if (!parse_expression(parser, arena, &definition->expression)) {
             parser_error(parser, "Expected expression");
         }
 
         expect(parser, QM_TOKEN_NEWLINE);
-    } else if (accept(parser, QM_TOKEN_FN)) {
+    } else if (accept_token(parser, QM_TOKEN_FN)) {
 		result = true;
 
-		if (!parse_identifier(parser, arena, &definition->variable)) {
+		if (!parse_identifier(parser, &definition->variable)) {
 			parser_error(parser, "Expected identifier, but found %s",
 				token_name[parser->token.type]);
 		}
 
 		expect(parser, QM_TOKEN_LPAREN);
 
-		definition->parameters = arena_alloc(arena, 128, u8 *);
-		u8 **parameter = definition->parameters;
+		definition->parameters = arena_alloc(arena, 128, u32);
+		u32 *parameter = definition->parameters;
 		u32 parameter_count = 0;
-		while (parser->result == 0 && !accept(parser, QM_TOKEN_RPAREN)) {
-			if (!parse_identifier(parser, arena, parameter)) {
+		while (parser->result == 0 && !accept_token(parser, QM_TOKEN_RPAREN)) {
+			if (!parse_identifier(parser, parameter)) {
 				parser_error(parser, "Expected identifier, but found %s",
 					token_name[parser->token.type]);
 			}
@@ -866,36 +1582,36 @@ parse_definition(struct qm_parser *parser, struct qm_memory_arena *arena,
 			parameter_count++;
 			parameter++;
 
-			if (!accept(parser, QM_TOKEN_COMMA)) {
+			if (!accept_token(parser, QM_TOKEN_COMMA)) {
 				expect(parser, QM_TOKEN_RPAREN);
 				break;
 			}
 		}
 
 		definition->parameter_count = parameter_count;
-		expect_identifier(parser, (u8 *)"=");
+		expect_identifier(parser, QM_SYMBOL_EQUALS);
 
 		if (!parse_expression(parser, arena, &definition->expression)) {
 			parser_error(parser, "Expected expression");
 		}
 
 		expect(parser, QM_TOKEN_NEWLINE);
-	} else if (accept(parser, QM_TOKEN_OPP)) {
+	} else if (accept_token(parser, QM_TOKEN_OPP)) {
 		result = true;
 		i32 rbp = ++parser->bp;
 
-		if (!parse_identifier(parser, arena, &definition->variable)) {
+		if (!parse_identifier(parser, &definition->variable)) {
 			parser_error(parser, "Expected identifier");
 		}
 
 		definition->parameter_count = 1;
-		definition->parameters = arena_alloc(arena, 1, u8 *);
+		definition->parameters = arena_alloc(arena, 1, u32);
 
-		if (!parse_identifier(parser, arena, &definition->parameters[0])) {
+		if (!parse_identifier(parser, &definition->parameters[0])) {
 			parser_error(parser, "Expected one parameter for the operator");
 		}
 
-		expect_identifier(parser, (u8 *)"=");
+		expect_identifier(parser, QM_SYMBOL_EQUALS);
 
 		if (!parse_expression(parser, arena, &definition->expression)) {
 			parser_error(parser, "Expected expression for definition");
@@ -904,28 +1620,32 @@ parse_definition(struct qm_parser *parser, struct qm_memory_arena *arena,
 		operator_define(&parser->operators, arena, definition->variable, 0, rbp);
 		expect(parser, QM_TOKEN_NEWLINE);
     } else {
-		u8 *operator = 0;
+		u32 operator = 0;
         i32 lbp, rbp;
         i32 bp = ++parser->bp;
 
-        if (accept(parser, QM_TOKEN_OP)) {
+        if (accept_token(parser, QM_TOKEN_OP)) {
             result = true;
             lbp = bp;
             rbp = bp + 1;
-        } else if (accept(parser, QM_TOKEN_OPR)) {
+        } else if (accept_token(parser, QM_TOKEN_OPR)) {
             result = true;
             lbp = bp + 1;
             rbp = bp;
         }
 
         if (result) {
-            if (accept(parser, QM_TOKEN_LBRACKET)) {
-                u8 *target_operator = 0;
-                if (parse_identifier(parser, arena, &target_operator)) {
-                    if (!operator_find(&parser->operators, target_operator,
-                            &lbp, &rbp)) {
+            if (accept_token(parser, QM_TOKEN_LBRACKET)) {
+                u32 target_operator = 0;
+                if (parse_identifier(parser, &target_operator)) {
+                    struct qm_operator *target = operator_find(
+                        &parser->operators, target_operator);
+                    if (target && (target->fixity & QM_FIXITY_INFIX)) {
+                        lbp = target->infix_lbp;
+                        rbp = target->infix_rbp;
+                    } else {
                         parser_error(parser, "Operator not found: %s",
-                            target_operator);
+                            symbol_name(target_operator));
                     }
 
                     // TODO: check if operator actually is right associative
@@ -942,25 +1662,25 @@ parse_definition(struct qm_parser *parser, struct qm_memory_arena *arena,
                 expect(parser, QM_TOKEN_RBRACKET);
             }
 
-            definition->parameters = arena_alloc(arena, 2, u8 *);
+            definition->parameters = arena_alloc(arena, 2, u32);
             definition->parameter_count = 2;
-            if (!parse_identifier(parser, arena, &definition->parameters[0])) {
+            if (!parse_identifier(parser, &definition->parameters[0])) {
                 parser_error(parser, "Expected identifier for first parameter");
             }
 
-            if (!parse_identifier(parser, arena, &operator)) {
+            if (!parse_identifier(parser, &operator)) {
                 parser_error(parser, "Expected identifier for the operator");
             }
 
-            if (!parse_identifier(parser, arena, &definition->parameters[1])) {
+            if (!parse_identifier(parser, &definition->parameters[1])) {
                 parser_error(parser, "Expected identifier for second parameter");
             }
 
-            expect_identifier(parser, (u8 *)"=");
+            expect_identifier(parser, QM_SYMBOL_EQUALS);
             if (!parse_expression(parser, arena, &definition->expression)) {
                 parser_error(parser,
                     "Expected expression for the definition of %s",
-                    (char *)definition->variable);
+                    symbol_name(operator));
             }
             expect(parser, QM_TOKEN_NEWLINE);
 
@@ -978,78 +1698,1657 @@ parse_statement(struct qm_parser *parser, struct qm_memory_arena *arena,
 {
 	bool result = true;
 
-	if (accept(parser, QM_TOKEN_NEWLINE)) {
+	stmt->offset = parser->token.start;
+	if (accept_token(parser, QM_TOKEN_NEWLINE)) {
 		stmt->type = QM_STMT_NONE;
 	} else if (parse_expression(parser, arena, &stmt->expression)) {
-		accept(parser, QM_TOKEN_NEWLINE);
+		accept_token(parser, QM_TOKEN_NEWLINE);
 		stmt->type = QM_STMT_EXPRESSION;
 	} else if (parse_definition(parser, arena, &stmt->definition)) {
 		stmt->type = QM_STMT_DEFINITION;
+	} else if (parser->token.type != QM_TOKEN_EOF) {
+		parser_error(parser, "Unexpected %s", token_name[parser->token.type]);
 	} else {
 		stmt->type = QM_STMT_NONE;
 		result = false;
 	}
 
+	if (parser->result != QM_OK) {
+		stmt->type = QM_STMT_NONE;
+		parser_recover(parser);
+	}
+
 	return result;
 }
 
-int
-main(int argc, char **argv)
+/*
+ * Evaluates all statements of the buffer of the parser. The memory of an
+ * expression is reclaimed once it was written, while definitions are kept
+ * since the environment refers to them. Returns whether anything was defined.
+ */
+static bool
+eval_statements(struct qm_parser *parser, struct tex_vm *vm,
+		struct qm_output *output, struct qm_memory_arena *arena,
+		struct tex_environment *env)
 {
-	struct qm_buffer json = {0};
-	struct qm_parser parser = {0};
-	struct qm_memory_arena arena = {0};
-	struct tex_environment env = {0};
+	bool has_definitions = false;
+	struct qm_statement statement = {0};
+	struct qm_arena_temp temp = arena_begin_temp(arena);
 
-	if (argc < 2) {
-		fprintf(stderr, "Not enough arguments\n");
-		return 1;
+	for (;;) {
+		/* NOTE: operators are defined while the statement is parsed. */
+		u32 operator_count = parser->operators.used;
+		if (output) {
+			stats_phase(QM_PHASE_PARSE);
+		}
+
+		if (!parse_statement(parser, arena, &statement)) {
+			break;
+		}
+
+		if (output) {
+			stats_phase(QM_PHASE_EVAL);
+		}
+
+		if (!tex_eval(vm, &statement, output, arena, env)) {
+			eval_error(parser->name, parser->buffer.data, statement.offset,
+				vm->error);
+			parser->error_count++;
+		}
+
+		if (statement.type == QM_STMT_DEFINITION ||
+				parser->operators.used != operator_count) {
+			has_definitions = true;
+			temp = arena_begin_temp(arena);
+		} else {
+			arena_end_temp(temp);
+		}
 	}
 
-	if (!file_read(argv[1], &arena, &parser.buffer)) {
-		fprintf(stderr, "Failed to read stdin: %s\n", strerror(errno));
-		return 1;
+	arena_end_temp(temp);
+	return has_definitions;
+}
+
+/* Returns whether the block contains a definition, before it is parsed. */
+static bool
+lex_has_definitions(struct qm_parser *parser)
+{
+	for (u32 i = 0; i < parser->token_count; i++) {
+		switch (parser->tokens[i].type) {
+		case QM_TOKEN_VAR:
+		case QM_TOKEN_FN:
+		case QM_TOKEN_OP:
+		case QM_TOKEN_OPR:
+		case QM_TOKEN_OPP:
+			return true;
+		default:
+			break;
+		}
 	}
 
-	if (!file_read(0, &arena, &json)) {
-		fprintf(stderr, "Failed to read file '%s': %s\n", argv[1], strerror(errno));
-		return 1;
+	return false;
+}
+
+/*
+ * Evaluates a block which was not found in the render cache, and adds it if
+ * it was rendered without errors. Blocks with definitions are not cached,
+ * but they change the state for the blocks after them.
+ */
+static bool
+eval_cached(struct qm_parser *parser, struct tex_vm *vm,
+		struct qm_output *output, struct qm_memory_arena *arena,
+		struct tex_environment *env, u64 hash, struct qm_output *rendered)
+{
+	u32 error_count = parser->error_count;
+	lex(parser);
+	if (lex_has_definitions(parser)) {
+		render_cache_define(hash);
+		output_raw(output, (u8 *)"\"", 1);
+		output->escape_json = true;
+		bool has_definitions = eval_statements(parser, vm, output, arena,
+			env);
+		output->escape_json = false;
+		output_raw(output, (u8 *)"\"", 1);
+		return has_definitions;
+	}
+
+	render_cache_miss();
+	rendered->used = 0;
+	rendered->escape_json = true;
+	bool has_definitions = eval_statements(parser, vm, rendered, arena, env);
+	output_raw(output, (u8 *)"\"", 1);
+	output_raw(output, rendered->data, rendered->used);
+	output_raw(output, (u8 *)"\"", 1);
+	if (parser->error_count == error_count) {
+		render_cache_insert(render_cache.state, hash, rendered->data,
+			rendered->used);
+	}
+
+	return has_definitions;
+}
+
+/* Evaluates the math blocks of the document in order. */
+static void
+eval_blocks(struct qm_json_scanner *json, struct qm_parser *parser,
+		struct tex_vm *vm, struct qm_output *output,
+		struct qm_memory_arena *arena, struct tex_environment *env,
+		struct qm_options *options)
+{
+	char block_name[32];
+	u32 block_count = 0;
+	parser->name = block_name;
+
+	struct qm_output rendered = {0};
+	struct qm_arena_temp block_temp = arena_begin_temp(arena);
+	stats_phase(QM_PHASE_SCAN);
+	while (pandoc_next_math_block(json, arena, &parser->buffer, output, 0)) {
+		snprintf(block_name, sizeof(block_name), "math block %u", ++block_count);
+
+		u64 hash;
+		struct qm_string cached;
+		bool has_definitions = false;
+		if (!render_cache.is_enabled) {
+			lex(parser);
+			output_raw(output, (u8 *)"\"", 1);
+			output->escape_json = true;
+			has_definitions = eval_statements(parser, vm, output, arena, env);
+			output->escape_json = false;
+			output_raw(output, (u8 *)"\"", 1);
+		} else if (render_cache_find(parser->buffer.data, parser->buffer.size,
+				&hash, &cached)) {
+			output_raw(output, (u8 *)"\"", 1);
+			output_raw(output, cached.data, cached.size);
+			output_raw(output, (u8 *)"\"", 1);
+		} else {
+			has_definitions = eval_cached(parser, vm, output, arena, env, hash,
+				&rendered);
+		}
+
+		/*
+		 * NOTE: flushing after each block lowers the latency for readers
+		 * of a pipe, otherwise the output is only written when the buffer
+		 * is full.
+		 */
+		if (options->flush == QM_FLUSH_BLOCK) {
+			output_flush(output);
+		}
+
+		/* NOTE: definitions refer to the source of the block. */
+		if (!has_definitions) {
+			arena_end_temp(block_temp);
+		}
+
+		stats_phase(QM_PHASE_SCAN);
+		block_temp = arena_begin_temp(arena);
+		parser->buffer.size = 0;
+		parser->buffer.data = 0;
+	}
+
+	output_finish(&rendered);
+	parser->name = 0;
+}
+
+/*
+ * Blocks without definitions only read the environment, so they can be
+ * evaluated in parallel. The blocks are lexed and parsed in order on the
+ * main thread, since the parser interns symbols and defines operators, and
+ * collected into a batch until a block with a definition is found. The
+ * workers then evaluate the batch with their own VMs and arenas, and the
+ * results are written in order between the pass-through bytes. Blocks with
+ * definitions are evaluated on the main thread, after the batch before them.
+ *
+ * The workers are started once per document and wait for the next batch.
+ * The main thread waits while they evaluate it, since the workers look up
+ * the symbols which the parser would intern into the same table.
+ */
+#define QM_BATCH_SIZE 1024
+
+/*
+ * NOTE: the pass-through bytes after the batch are held in memory until it
+ * is written, so the batch is written early once there are this many.
+ */
+#define QM_PASSTHROUGH_LIMIT (1 << 20)
+
+struct qm_job {
+	struct qm_statement *statements;
+	u32 statement_count;
+	u32 statement_capacity;
+
+	/* NOTE: the source of the block, for the errors of the statements. */
+	const u8 *source;
+	u32 block;
+
+	/* NOTE: the output is written at this offset of the pass-through. */
+	usize offset;
+	u32 worker;
+	usize output_start;
+	usize output_end;
+	u32 error_count;
+
+	/* NOTE: the output is added to the render cache if this is set. */
+	bool is_cached;
+	u64 cache_state;
+	u64 cache_hash;
+};
+
+struct qm_worker {
+#if QM_THREADS
+	pthread_t thread;
+#endif
+	struct qm_batch *batch;
+	u32 index;
+	struct tex_vm vm;
+	struct qm_memory_arena arena;
+	struct qm_output output;
+#if QM_STATS
+	struct qm_stats stats;
+#endif
+};
+
+struct qm_batch {
+	struct qm_job *jobs;
+	u32 job_count;
+	u32 job_capacity;
+	u32 next_job;
+#if QM_THREADS
+	/* NOTE: the workers only take the jobs before ready_count. */
+	u32 ready_count;
+	u32 done_count;
+	bool is_closed;
+	pthread_mutex_t lock;
+	pthread_cond_t has_jobs;
+	pthread_cond_t is_done;
+#endif
+	struct tex_environment *env;
+};
+
+static struct qm_job *
+batch_push(struct qm_batch *batch)
+{
+	if (batch->job_count == batch->job_capacity) {
+		batch->job_capacity = MAX(2 * batch->job_capacity, 64);
+		batch->jobs = realloc(batch->jobs,
+			batch->job_capacity * sizeof(*batch->jobs));
+		if (!batch->jobs) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	operator_define(&parser.operators, &arena, (u8 *)"__unwrap__", 0, 100);
+	struct qm_job *job = &batch->jobs[batch->job_count++];
+	memset(job, 0, sizeof(*job));
+	return job;
+}
+
+static void
+parse_job(struct qm_parser *parser, struct qm_memory_arena *arena,
+		struct qm_job *job)
+{
+	stats_phase(QM_PHASE_PARSE);
 
 	struct qm_statement statement = {0};
-	while (parse_statement(&parser, &arena, &statement)) {
-		tex_eval(&statement, 0, &arena, &env);
+	while (parse_statement(parser, arena, &statement)) {
+		if (statement.type == QM_STMT_NONE) {
+			continue;
+		}
+
+		if (job->statement_count == job->statement_capacity) {
+			job->statement_capacity = MAX(2 * job->statement_capacity, 4);
+			job->statements = realloc(job->statements,
+				job->statement_capacity * sizeof(*job->statements));
+			if (!job->statements) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		job->statements[job->statement_count++] = statement;
+	}
+}
+
+/*
+ * Takes the next job of the batch. Without threads, the batch is evaluated
+ * by one call to worker_run, which returns once it is done. Otherwise, the
+ * workers wait until there are jobs or the batch is closed.
+ */
+static bool
+batch_take(struct qm_batch *batch, u32 *index)
+{
+#if QM_THREADS
+	pthread_mutex_lock(&batch->lock);
+	while (batch->next_job == batch->ready_count && !batch->is_closed) {
+		pthread_cond_wait(&batch->has_jobs, &batch->lock);
 	}
 
-	parser.buffer.start = 0;
-	parser.buffer.data  = 0;
-	parser.buffer.size  = 0;
+	bool result = batch->next_job < batch->ready_count;
+	*index = batch->next_job;
+	batch->next_job += result;
+	pthread_mutex_unlock(&batch->lock);
+	return result;
+#else
+	*index = batch->next_job++;
+	return *index < batch->job_count;
+#endif
+}
 
-	while (pandoc_next_math_block(&json, &arena, &parser.buffer)) {
-		parser.buffer.start = 0;
-		assert(parser.buffer.size != 0);
-		assert(parser.buffer.start == 0);
-		assert(parser.buffer.start == 0);
-		tokenize(&parser.buffer, &parser.token);
+static void *
+worker_run(void *arg)
+{
+	struct qm_worker *worker = arg;
+	struct qm_batch *batch = worker->batch;
+#if QM_STATS
+	stats.is_worker = true;
+#endif
+	stats_phase(QM_PHASE_EVAL);
+
+	u32 i;
+	while (batch_take(batch, &i)) {
+		struct qm_job *job = &batch->jobs[i];
+		job->worker = worker->index;
+		job->output_start = worker->output.used;
+		for (u32 j = 0; j < job->statement_count; j++) {
+			struct qm_statement *statement = &job->statements[j];
+			struct qm_arena_temp temp = arena_begin_temp(&worker->arena);
+			if (!tex_eval(&worker->vm, statement, &worker->output,
+					&worker->arena, batch->env)) {
+				char block_name[32];
+				snprintf(block_name, sizeof(block_name), "math block %u",
+					job->block);
+				eval_error(block_name, job->source, statement->offset,
+					worker->vm.error);
+				job->error_count++;
+			}
 
-		putchar('"');
-		struct qm_statement statement = {0};
-		while (parse_statement(&parser, &arena, &statement)) {
-			struct qm_buffer output = {0};
-			output.size = tex_eval(&statement, 0, &arena, &env);
-			output.data = arena_alloc(&arena, output.size + 1, u8);
+			arena_end_temp(temp);
+		}
 
-			tex_eval(&statement, &output, &arena, &env);
-			pandoc_print_string(output.data, output.size);
+		job->output_end = worker->output.used;
+#if QM_THREADS
+		pthread_mutex_lock(&batch->lock);
+		if (++batch->done_count == batch->ready_count) {
+			pthread_cond_signal(&batch->is_done);
 		}
-		putchar('"');
 
-		parser.buffer.size = 0;
-		parser.buffer.data = 0;
+		pthread_mutex_unlock(&batch->lock);
+#endif
 	}
 
-	arena_finish(&arena);
+#if QM_STATS
+	worker->stats = stats;
+#endif
 	return 0;
 }
+
+#if QM_THREADS
+static void
+batch_start(struct qm_batch *batch, struct qm_worker *workers,
+		u32 worker_count)
+{
+	pthread_mutex_init(&batch->lock, 0);
+	pthread_cond_init(&batch->has_jobs, 0);
+	pthread_cond_init(&batch->is_done, 0);
+
+	/*
+	 * NOTE: the compiler recurses over the expressions, so the workers get
+	 * the same stack size as the main thread.
+	 */
+	pthread_attr_t attr;
+	struct rlimit limit;
+	pthread_attr_init(&attr);
+	if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+		pthread_attr_setstacksize(&attr, limit.rlim_cur);
+	}
+
+	for (u32 i = 0; i < worker_count; i++) {
+		if (pthread_create(&workers[i].thread, &attr, worker_run, &workers[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+/* Stops the workers once the last batch was written. */
+static void
+batch_stop(struct qm_batch *batch, struct qm_worker *workers,
+		u32 worker_count)
+{
+	pthread_mutex_lock(&batch->lock);
+	batch->is_closed = true;
+	pthread_cond_broadcast(&batch->has_jobs);
+	pthread_mutex_unlock(&batch->lock);
+
+	for (u32 i = 0; i < worker_count; i++) {
+		pthread_join(workers[i].thread, 0);
+#if QM_STATS
+		stats_merge(&workers[i].stats);
+#endif
+	}
+
+	pthread_cond_destroy(&batch->is_done);
+	pthread_cond_destroy(&batch->has_jobs);
+	pthread_mutex_destroy(&batch->lock);
+}
+#endif
+
+/*
+ * Evaluates the batch and writes it with the pass-through bytes before.
+ * Returns the number of statements which failed at runtime.
+ */
+static u32
+batch_flush(struct qm_batch *batch, struct qm_worker *workers,
+		u32 worker_count, struct qm_output *passthrough,
+		struct qm_output *output, struct qm_options *options)
+{
+	for (u32 i = 0; i < worker_count; i++) {
+		workers[i].output.used = 0;
+	}
+
+#if QM_THREADS
+	if (batch->job_count > 0) {
+		pthread_mutex_lock(&batch->lock);
+		batch->ready_count = batch->job_count;
+		pthread_cond_broadcast(&batch->has_jobs);
+		while (batch->done_count < batch->ready_count) {
+			pthread_cond_wait(&batch->is_done, &batch->lock);
+		}
+
+		pthread_mutex_unlock(&batch->lock);
+	}
+#else
+	batch->next_job = 0;
+	worker_run(&workers[0]);
+#endif
+
+	usize offset = 0;
+	u32 error_count = 0;
+	for (u32 i = 0; i < batch->job_count; i++) {
+		struct qm_job *job = &batch->jobs[i];
+		error_count += job->error_count;
+		struct qm_output *result = &workers[job->worker].output;
+		output_raw(output, passthrough->data + offset, job->offset - offset);
+		output_raw(output, (u8 *)"\"", 1);
+		output_raw(output, result->data + job->output_start,
+			job->output_end - job->output_start);
+		output_raw(output, (u8 *)"\"", 1);
+		if (job->is_cached && job->error_count == 0) {
+			render_cache_insert(job->cache_state, job->cache_hash,
+				result->data + job->output_start,
+				job->output_end - job->output_start);
+		}
+
+		if (options->flush == QM_FLUSH_BLOCK) {
+			output_flush(output);
+		}
+
+		offset = job->offset;
+		free(job->statements);
+	}
+
+	output_raw(output, passthrough->data + offset, passthrough->used - offset);
+	if (options->flush == QM_FLUSH_BLOCK) {
+		output_flush(output);
+	}
+
+	passthrough->used = 0;
+	batch->job_count = 0;
+#if QM_THREADS
+	/* NOTE: the workers are waiting, so the next batch starts from zero. */
+	pthread_mutex_lock(&batch->lock);
+	batch->next_job = 0;
+	batch->ready_count = 0;
+	batch->done_count = 0;
+	pthread_mutex_unlock(&batch->lock);
+#endif
+	return error_count;
+}
+
+static void
+eval_parallel(struct qm_json_scanner *json, struct qm_parser *parser,
+		struct tex_vm *vm, struct qm_output *output,
+		struct qm_memory_arena *arena, struct tex_environment *env,
+		struct qm_options *options)
+{
+	struct qm_output passthrough = {0};
+	struct qm_batch batch = {0};
+	batch.env = env;
+#if QM_THREADS
+	u32 worker_count = options->jobs;
+#else
+	u32 worker_count = 1;
+#endif
+
+	struct qm_worker *workers = calloc(worker_count, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (u32 i = 0; i < worker_count; i++) {
+		workers[i].index = i;
+		workers[i].batch = &batch;
+		workers[i].output.escape_json = true;
+	}
+
+#if QM_THREADS
+	batch_start(&batch, workers, worker_count);
+#endif
+
+	char block_name[32];
+	u32 block_count = 0;
+	parser->name = block_name;
+
+	/*
+	 * NOTE: flushing after each block only lowers the latency if the
+	 * batches are small, so there is one block for each worker.
+	 */
+	u32 batch_size = QM_BATCH_SIZE;
+	if (options->flush == QM_FLUSH_BLOCK) {
+		batch_size = worker_count;
+	}
+
+	struct qm_arena_temp batch_temp = arena_begin_temp(arena);
+	stats_phase(QM_PHASE_SCAN);
+	for (;;) {
+		if (!pandoc_next_math_block(json, arena, &parser->buffer, &passthrough,
+				QM_PASSTHROUGH_LIMIT)) {
+			if (passthrough.used < QM_PASSTHROUGH_LIMIT) {
+				break;
+			}
+
+			parser->error_count += batch_flush(&batch, workers, worker_count,
+				&passthrough, output, options);
+			arena_end_temp(batch_temp);
+			batch_temp = arena_begin_temp(arena);
+			continue;
+		}
+
+		snprintf(block_name, sizeof(block_name), "math block %u", ++block_count);
+
+		/* NOTE: cached blocks are written like the pass-through bytes. */
+		u64 hash = 0;
+		struct qm_string cached;
+		if (render_cache.is_enabled && render_cache_find(parser->buffer.data,
+				parser->buffer.size, &hash, &cached)) {
+			output_raw(&passthrough, (u8 *)"\"", 1);
+			output_raw(&passthrough, cached.data, cached.size);
+			output_raw(&passthrough, (u8 *)"\"", 1);
+			if (options->flush == QM_FLUSH_BLOCK) {
+				parser->error_count += batch_flush(&batch, workers,
+					worker_count, &passthrough, output, options);
+				arena_end_temp(batch_temp);
+				batch_temp = arena_begin_temp(arena);
+			}
+
+			stats_phase(QM_PHASE_SCAN);
+			continue;
+		}
+
+		u32 error_count = parser->error_count;
+		lex(parser);
+
+		if (!lex_has_definitions(parser)) {
+			if (render_cache.is_enabled) {
+				render_cache_miss();
+			}
+
+			struct qm_job *job = batch_push(&batch);
+			job->source = parser->buffer.data;
+			job->block = block_count;
+			job->offset = passthrough.used;
+			parse_job(parser, arena, job);
+			if (render_cache.is_enabled && parser->error_count == error_count) {
+				job->is_cached = true;
+				job->cache_state = render_cache.state;
+				job->cache_hash = hash;
+			}
+
+			if (batch.job_count == batch_size) {
+				parser->error_count += batch_flush(&batch, workers,
+					worker_count, &passthrough, output, options);
+				arena_end_temp(batch_temp);
+				batch_temp = arena_begin_temp(arena);
+			}
+
+			stats_phase(QM_PHASE_SCAN);
+			continue;
+		}
+
+		/*
+		 * NOTE: the source of the block is moved out of the memory of the
+		 * batch, since the definitions refer to it.
+		 */
+		usize size = parser->buffer.size;
+		u8 *source = malloc(size + 1);
+		if (!source) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+
+		memcpy(source, parser->buffer.data, size + 1);
+		parser->error_count += batch_flush(&batch, workers, worker_count,
+			&passthrough, output, options);
+		arena_end_temp(batch_temp);
+		parser->buffer.data = arena_alloc(arena, size + 1, u8);
+		memcpy(parser->buffer.data, source, size + 1);
+		free(source);
+
+		if (render_cache.is_enabled) {
+			render_cache_define(hash);
+		}
+
+		output_raw(output, (u8 *)"\"", 1);
+		output->escape_json = true;
+		eval_statements(parser, vm, output, arena, env);
+		output->escape_json = false;
+		output_raw(output, (u8 *)"\"", 1);
+		if (options->flush == QM_FLUSH_BLOCK) {
+			output_flush(output);
+		}
+
+		stats_phase(QM_PHASE_SCAN);
+		batch_temp = arena_begin_temp(arena);
+	}
+
+	parser->error_count += batch_flush(&batch, workers, worker_count,
+		&passthrough, output, options);
+	arena_end_temp(batch_temp);
+#if QM_THREADS
+	batch_stop(&batch, workers, worker_count);
+#endif
+
+	for (u32 i = 0; i < worker_count; i++) {
+		tex_vm_finish(&workers[i].vm);
+		output_finish(&workers[i].output);
+		arena_finish(&workers[i].arena);
+	}
+
+	free(workers);
+	free(batch.jobs);
+	output_finish(&passthrough);
+	parser->name = 0;
+}
+
+/*
+ * Adds a document of the batch, which is given as input:output. The pair is
+ * split at the last colon, so only the input path can contain one.
+ */
+static bool
+options_add_document(struct qm_options *options, char *pair)
+{
+	char *separator = strrchr(pair, ':');
+	if (!separator || separator == pair || separator[1] == '\0') {
+		fprintf(stderr, "Expected input.json:output.json, but found '%s'\n",
+			pair);
+		return false;
+	}
+
+	if (options->document_count == options->document_capacity) {
+		options->document_capacity = MAX(2 * options->document_capacity, 16);
+		options->documents = realloc(options->documents,
+			options->document_capacity * sizeof(*options->documents));
+		if (!options->documents) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	*separator = '\0';
+	struct qm_document *document = &options->documents[options->document_count++];
+	document->input_path = pair;
+	document->output_path = separator + 1;
+	return true;
+}
+
+/*
+ * Reads the documents of the batch from the manifest, which has one
+ * input:output pair per line. Empty lines and lines starting with # are
+ * skipped.
+ */
+static bool
+options_read_manifest(struct qm_options *options, const char *path)
+{
+	struct qm_buffer *manifest = &options->manifest;
+	if (!file_read(path, 0, manifest)) {
+		fprintf(stderr, "Failed to read file '%s': %s\n", path,
+			strerror(errno));
+		return false;
+	}
+
+	char *line = (char *)manifest->data;
+	char *end = line + manifest->size;
+	while (line < end) {
+		char *next = memchr(line, '\n', end - line);
+		next = next ? next : end;
+		*next = '\0';
+		if (next > line && next[-1] == '\r') {
+			next[-1] = '\0';
+		}
+
+		if (line[0] != '\0' && line[0] != '#' &&
+				!options_add_document(options, line)) {
+			return false;
+		}
+
+		line = next + 1;
+	}
+
+	return true;
+}
+
+static void
+options_finish(struct qm_options *options)
+{
+	free(options->documents);
+	free(options->manifest.data);
+}
+
+/* Parses a number of bytes with an optional K, M or G suffix. */
+static bool
+options_parse_size(const char *str, u64 *size)
+{
+	char *end;
+	errno = 0;
+	unsigned long long value = strtoull(str, &end, 10);
+	if (errno != 0 || end == str || value == 0) {
+		return false;
+	}
+
+	const char *units = "KMG";
+	const char *unit = *end ? strchr(units, *end) : 0;
+	if (unit) {
+		value <<= 10 * (unit - units + 1);
+		end++;
+	}
+
+	*size = value;
+	return *end == '\0';
+}
+
+#define QM_MAX_JOBS 256
+
+/* Parses the number of threads for -j, which is at most QM_MAX_JOBS. */
+static bool
+options_parse_jobs(const char *str, u32 *jobs)
+{
+	char *end;
+	errno = 0;
+	unsigned long value = strtoul(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || str[0] == '-' ||
+			value == 0 || value > QM_MAX_JOBS) {
+		return false;
+	}
+
+	*jobs = (u32)value;
+	return true;
+}
+
+static bool
+options_parse(struct qm_options *options, int argc, char **argv)
+{
+	for (i32 i = 1; i < argc; i++) {
+		char *arg = argv[i];
+
+		if (strcmp(arg, "--memo") == 0) {
+			options->memo = true;
+		} else if (strcmp(arg, "--memo-stats") == 0) {
+			options->memo = true;
+			options->memo_stats = true;
+		} else if (strcmp(arg, "--huge-pages") == 0) {
+			options->huge_pages = true;
+		} else if (strcmp(arg, "--stats") == 0) {
+			options->stats = true;
+		} else if (strcmp(arg, "--stats=json") == 0) {
+			options->stats = true;
+			options->stats_json = true;
+		} else if (strcmp(arg, "--flush=block") == 0) {
+			options->flush = QM_FLUSH_BLOCK;
+		} else if (strcmp(arg, "--flush=buffer") == 0) {
+			options->flush = QM_FLUSH_BUFFER;
+		} else if (strcmp(arg, "-j") == 0) {
+			if (++i == argc || !options_parse_jobs(argv[i], &options->jobs)) {
+				fprintf(stderr, "Expected a number of threads from 1 to %d for "
+					"-j\n", QM_MAX_JOBS);
+				return false;
+			}
+		} else if (strcmp(arg, "-i") == 0) {
+			if (++i == argc) {
+				fprintf(stderr, "Missing argument for -i\n");
+				return false;
+			}
+
+			options->input_path = argv[i];
+		} else if (strcmp(arg, "--compile") == 0) {
+			options->compile = true;
+		} else if (strcmp(arg, "-o") == 0 || strcmp(arg, "--cache") == 0) {
+			if (++i == argc) {
+				fprintf(stderr, "Missing argument for %s\n", arg);
+				return false;
+			}
+
+			options->image_path = argv[i];
+		} else if (strcmp(arg, "--render-cache") == 0) {
+			if (++i == argc) {
+				fprintf(stderr, "Missing argument for --render-cache\n");
+				return false;
+			}
+
+			options->render_cache_path = argv[i];
+		} else if (strcmp(arg, "--render-cache-size") == 0) {
+			if (++i == argc || !options_parse_size(argv[i],
+					&options->render_cache_size)) {
+				fprintf(stderr, "Expected a size for --render-cache-size\n");
+				return false;
+			}
+#if QM_SERVER
+		} else if (strcmp(arg, "--server") == 0) {
+			options->server = true;
+		} else if (strcmp(arg, "--socket") == 0) {
+			if (++i == argc) {
+				fprintf(stderr, "Missing argument for --socket\n");
+				return false;
+			}
+
+			options->server = true;
+			options->socket_path = argv[i];
+#endif
+		} else if (strcmp(arg, "--batch") == 0) {
+			options->batch = true;
+		} else if (strcmp(arg, "--manifest") == 0) {
+			if (++i == argc) {
+				fprintf(stderr, "Missing argument for --manifest\n");
+				return false;
+			}
+
+			options->batch = true;
+			if (!options_read_manifest(options, argv[i])) {
+				return false;
+			}
+		} else if (arg[0] == '-' && arg[1] != '\0') {
+			fprintf(stderr, "Unknown option: %s\n", arg);
+			return false;
+		} else if (!options->macro_path) {
+			options->macro_path = arg;
+		} else if (options->batch || strchr(arg, ':')) {
+			/* NOTE: the pairs can also be given before --batch. */
+			if (!options_add_document(options, arg)) {
+				return false;
+			}
+		} else {
+			fprintf(stderr, "Unexpected argument: %s\n", arg);
+			return false;
+		}
+	}
+
+	if (!options->macro_path) {
+		fprintf(stderr, "Not enough arguments\n");
+		return false;
+	} else if (options->compile && !options->image_path) {
+		fprintf(stderr, "Missing output file for --compile\n");
+		return false;
+	} else if (options->document_count > 0 && !options->batch) {
+		fprintf(stderr, "Missing --batch for the documents\n");
+		return false;
+	} else if (options->batch && (options->server || options->input_path)) {
+		fprintf(stderr, "A batch can't be combined with -i or a server\n");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * The macro library is evaluated once and then shared by the documents. The
+ * library owns the symbols, since they hold the flags of its parameters.
+ */
+struct qm_library {
+	struct qm_buffer macros;
+	/* NOTE: the compiled library, see image.c. */
+	struct qm_buffer image;
+	struct qm_parser parser;
+	struct qm_memory_arena arena;
+	struct tex_environment env;
+	struct tex_vm vm;
+	struct tex_memo memo;
+
+	/* NOTE: the environment of each document starts at a new version. */
+	u32 next_version;
+	/* NOTE: identifies the macros for the image and the render cache. */
+	u64 source_hash;
+#if QM_SERVER
+	struct stat file;
+#endif
+};
+
+/*
+ * Loads the compiled library instead of evaluating the macros. Fails if
+ * there is no valid image for the source.
+ */
+static bool
+library_load_image(struct qm_library *library, const char *path,
+		u64 source_hash)
+{
+	struct qm_buffer *image = &library->image;
+	if (!file_map(path, image, true) &&
+			!file_read(path, &library->arena, image)) {
+		return false;
+	}
+
+	struct qm_parser *parser = &library->parser;
+	if (!image_load(image->data, image->size, source_hash, &parser->operators,
+			&parser->bp, &library->env)) {
+		/* NOTE: some of the symbols of the image may have been interned. */
+		file_close(image);
+		memset(image, 0, sizeof(*image));
+		symbols_finish();
+		symbols_init();
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+library_load(struct qm_library *library, struct qm_options *options)
+{
+	if (options->memo) {
+		library->vm.memo = &library->memo;
+	}
+
+	symbols_init();
+
+#if QM_SERVER
+	if (stat(options->macro_path, &library->file) != 0) {
+		memset(&library->file, 0, sizeof(library->file));
+	}
+#endif
+
+	/* NOTE: the server reads the file, since it could be edited in place. */
+	if ((options->server || !file_map(options->macro_path, &library->macros,
+			false)) &&
+			!file_read(options->macro_path, &library->arena,
+				&library->macros)) {
+		fprintf(stderr, "Failed to read file '%s': %s\n", options->macro_path,
+			strerror(errno));
+		return false;
+	}
+
+	/* NOTE: the image is compiled again if it doesn't match the source. */
+	u64 source_hash = image_hash(library->macros.data, library->macros.size);
+	library->source_hash = source_hash;
+	if (options->image_path) {
+		if (!options->compile && library_load_image(library,
+				options->image_path, source_hash)) {
+			library->next_version = library->env.version + 1;
+			return true;
+		}
+	}
+
+	struct qm_parser *parser = &library->parser;
+	operator_define(&parser->operators, &library->arena, QM_SYMBOL_UNWRAP,
+		0, 100);
+
+	/*
+	 * NOTE: the AST and the values refer to the source buffers, so they
+	 * have to stay alive until the end.
+	 */
+	stats_phase(QM_PHASE_MACROS);
+	parser->buffer = library->macros;
+	parser->name = options->macro_path;
+	lex(parser);
+	eval_statements(parser, &library->vm, 0, &library->arena, &library->env);
+
+	parser->buffer.start = 0;
+	parser->buffer.data  = 0;
+	parser->buffer.size  = 0;
+	parser->name = 0;
+	library->next_version = library->env.version + 1;
+
+	/* NOTE: the image is written before the documents change the library. */
+	if (options->image_path && parser->error_count == 0 &&
+			!image_write(options->image_path, source_hash, &parser->operators,
+				parser->bp, &library->env)) {
+		fprintf(stderr, "Failed to write file '%s': %s\n",
+			options->image_path, strerror(errno));
+		return !options->compile;
+	}
+
+	return true;
+}
+
+static void
+library_finish(struct qm_library *library)
+{
+	tex_memo_finish(&library->memo);
+	tex_vm_finish(&library->vm);
+	free(library->parser.tokens);
+	free(library->parser.lines);
+	free(library->parser.scratch);
+	file_close(&library->macros);
+	file_close(&library->image);
+	symbols_finish();
+	arena_finish(&library->arena);
+	memset(library, 0, sizeof(*library));
+}
+
+/* Evaluates the math blocks of the document with the environment. */
+static void
+library_eval(struct qm_library *library, struct qm_json_scanner *json,
+		struct qm_output *output, struct tex_environment *env,
+		struct qm_options *options)
+{
+	if (render_cache.is_enabled) {
+		render_cache_begin(library->source_hash);
+	}
+
+	if (options->jobs > 1) {
+		eval_parallel(json, &library->parser, &library->vm, output,
+			&library->arena, env, options);
+	} else {
+		eval_blocks(json, &library->parser, &library->vm, output,
+			&library->arena, env, options);
+	}
+}
+
+/*
+ * Renders a document without changing the library. The definitions of the
+ * document go into a child environment on top of the library, which is
+ * freed with the arena. The operators and the symbols are changed by the
+ * parser in place, so they are saved before and restored afterwards. The
+ * memo is reset, since its results can refer to the code of the document.
+ * Without a library, e.g. if it failed to reload, the document is copied.
+ */
+static void
+library_render(struct qm_library *library, struct qm_options *options,
+		struct qm_buffer *document, struct qm_output *output)
+{
+	struct qm_parser *parser = &library->parser;
+	if (!library->macros.data) {
+		output_raw(output, document->data, document->size);
+		return;
+	}
+
+	struct qm_symbol_snapshot symbols = symbols_save();
+	struct qm_operator_table operators = parser->operators;
+	struct qm_operator_table saved = operator_table_save(&parser->operators);
+	i32 bp = parser->bp;
+	struct qm_arena_temp temp = arena_begin_temp(&library->arena);
+
+	struct tex_environment env = {0};
+	env.parent = &library->env;
+	env.version = library->next_version;
+
+	struct qm_json_scanner json = {0};
+	json.input.data = document->data;
+	json.input.size = document->size;
+	library_eval(library, &json, output, &env, options);
+	pandoc_finish(&json);
+
+	library->next_version = env.version + 1;
+	arena_end_temp(temp);
+	operator_table_restore(&parser->operators, &operators, &saved);
+	parser->bp = bp;
+	symbols_restore(&symbols);
+	tex_memo_reset(&library->memo);
+}
+
+#if QM_SERVER
+/*
+ * Server mode keeps the library loaded between documents, which are
+ * rendered with library_render. The library is loaded again when the macro
+ * file changes. If the new file can't be read or has errors, the previous
+ * library is kept, or the documents are copied unchanged if there is none.
+ */
+static bool
+library_is_stale(struct qm_library *library, const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		/* NOTE: the file is probably being replaced, keep the old one. */
+		return false;
+	}
+
+	return st.st_ino != library->file.st_ino ||
+		st.st_size != library->file.st_size ||
+		st.st_mtime != library->file.st_mtime ||
+		st.st_ctime != library->file.st_ctime;
+}
+
+static void
+server_reload(struct qm_library *library, struct qm_options *options)
+{
+	if (library->macros.data &&
+			!library_is_stale(library, options->macro_path)) {
+		return;
+	}
+
+	/*
+	 * NOTE: the new library is loaded with its own symbols, so that the
+	 * old one can still be used if it fails.
+	 */
+	struct qm_symbol_table old_symbols = symbols;
+	memset(&symbols, 0, sizeof(symbols));
+
+	struct qm_library loaded = {0};
+	if (!library_load(&loaded, options) || loaded.parser.error_count > 0) {
+		fprintf(stderr, "Failed to reload '%s', %s\n", options->macro_path,
+			library->macros.data ? "the previous macros are kept" :
+			"the documents are not changed");
+
+		/* NOTE: the file is only loaded again once it changes. */
+		library->file = loaded.file;
+		library_finish(&loaded);
+		symbols = old_symbols;
+		return;
+	}
+
+	struct qm_symbol_table new_symbols = symbols;
+	struct tex_memo memo = library->memo;
+	symbols = old_symbols;
+	library_finish(library);
+	symbols = new_symbols;
+
+	*library = loaded;
+	if (library->vm.memo) {
+		library->vm.memo = &library->memo;
+	}
+
+	/* NOTE: the statistics of the memo are kept across reloads. */
+	library->memo.hits = memo.hits;
+	library->memo.misses = memo.misses;
+}
+
+/*
+ * Reads a request from standard input, which is the length of the document
+ * in decimal on its own line followed by the document. Returns false at the
+ * end of the input.
+ */
+static bool
+server_read(FILE *file, struct qm_buffer *request, usize *capacity)
+{
+	usize size;
+	if (fscanf(file, "%zu", &size) != 1 || fgetc(file) != '\n') {
+		return false;
+	}
+
+	if (size > *capacity) {
+		u8 *data = realloc(request->data, size);
+		if (!data) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+
+		request->data = data;
+		*capacity = size;
+	}
+
+	request->size = fread(request->data, 1, size, file);
+	if (request->size != size) {
+		fprintf(stderr, "Truncated request of %zu bytes\n", size);
+		return false;
+	}
+
+	return true;
+}
+
+/* Reads the request of a client, which ends when it shuts down writing. */
+static bool
+server_receive(int fd, struct qm_buffer *request, usize *capacity)
+{
+	request->size = 0;
+	for (;;) {
+		if (request->size == *capacity) {
+			usize size = MAX(2 * *capacity, 1 << 16);
+			u8 *data = realloc(request->data, size);
+			if (!data) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+
+			request->data = data;
+			*capacity = size;
+		}
+
+		ssize_t n = read(fd, request->data + request->size,
+			*capacity - request->size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			return false;
+		} else if (n == 0) {
+			return true;
+		}
+
+		request->size += n;
+	}
+}
+
+static bool
+server_send(int fd, const u8 *data, usize size)
+{
+	while (size > 0) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			return false;
+		}
+
+		data += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+static int
+server_listen(const char *path)
+{
+	struct sockaddr_un address = {0};
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(address.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	/*
+	 * NOTE: only a stale socket is replaced, never any other file. The
+	 * socket is stale if no server accepts connections on it anymore.
+	 */
+	struct stat st;
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			close(fd);
+			errno = EEXIST;
+			return -1;
+		}
+
+		if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0 ||
+				errno != ECONNREFUSED) {
+			close(fd);
+			errno = EADDRINUSE;
+			return -1;
+		}
+
+		/* NOTE: a socket which failed to connect can't be bound again. */
+		close(fd);
+		unlink(path);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			return -1;
+		}
+	}
+
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+			listen(fd, 64) != 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Renders the requests from standard input, or one document per connection
+ * if a socket is given, until the input ends.
+ */
+/*
+ * NOTE: the render cache is only saved for new entries, the ticks of the
+ * entries which were used are saved with them or at the end.
+ */
+static void
+server_save(void)
+{
+	if (render_cache.is_dirty) {
+		render_cache_save();
+	}
+}
+
+static bool
+server_run(struct qm_library *library, struct qm_options *options)
+{
+	struct qm_buffer request = {0};
+	struct qm_output output = {0};
+	usize capacity = 0;
+	bool result = true;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (options->socket_path) {
+		int fd = server_listen(options->socket_path);
+		if (fd < 0) {
+			fprintf(stderr, "Failed to listen on '%s': %s\n",
+				options->socket_path, strerror(errno));
+			return false;
+		}
+
+		for (;;) {
+			int client = accept(fd, 0, 0);
+			if (client < 0 && errno == EINTR) {
+				continue;
+			} else if (client < 0) {
+				perror("accept");
+				result = false;
+				break;
+			}
+
+			if (server_receive(client, &request, &capacity)) {
+				server_reload(library, options);
+				output.used = 0;
+				library_render(library, options, &request, &output);
+				if (!server_send(client, output.data, output.used)) {
+					perror("write");
+				}
+
+				server_save();
+			}
+
+			close(client);
+		}
+
+		close(fd);
+	} else {
+		while (server_read(stdin, &request, &capacity)) {
+			server_reload(library, options);
+			output.used = 0;
+			library_render(library, options, &request, &output);
+
+			printf("%zu\n", output.used);
+			if (output.used > 0) {
+				fwrite(output.data, 1, output.used, stdout);
+			}
+
+			if (fflush(stdout) != 0) {
+				perror("write");
+				result = false;
+				break;
+			}
+
+			server_save();
+		}
+	}
+
+	free(request.data);
+	output_finish(&output);
+	return result;
+}
+#endif
+
+/*
+ * Batch mode renders many documents with one library. Each document gets
+ * its own view of the library through library_render, so its definitions
+ * don't leak into the next one.
+ */
+static bool
+batch_render(struct qm_library *library, struct qm_options *options,
+		struct qm_document *document)
+{
+	struct qm_buffer input = {0};
+	if (!file_map(document->input_path, &input, false) &&
+			!file_read(document->input_path, 0, &input)) {
+		fprintf(stderr, "Failed to read file '%s': %s\n",
+			document->input_path, strerror(errno));
+		return false;
+	}
+
+	/*
+	 * NOTE: the output is written next to the file and renamed, since it
+	 * could be the mapped input.
+	 */
+	char tmp_path[4096];
+	struct qm_output output = {0};
+	if ((usize)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp",
+			document->output_path) >= sizeof(tmp_path)) {
+		errno = ENAMETOOLONG;
+	} else {
+		output.file = fopen(tmp_path, "wb");
+	}
+
+	if (!output.file) {
+		fprintf(stderr, "Failed to write file '%s': %s\n",
+			document->output_path, strerror(errno));
+		file_close(&input);
+		return false;
+	}
+
+	u32 error_count = library->parser.error_count;
+	library_render(library, options, &input, &output);
+	output_finish(&output);
+
+	/* NOTE: the output can refer to the input until it is flushed. */
+	file_close(&input);
+
+	bool is_written = !ferror(output.file);
+	is_written &= fclose(output.file) == 0;
+	is_written = is_written && rename(tmp_path, document->output_path) == 0;
+	if (!is_written) {
+		fprintf(stderr, "Failed to write file '%s': %s\n",
+			document->output_path, strerror(errno));
+		remove(tmp_path);
+	}
+
+	return is_written && library->parser.error_count == error_count;
+}
+
+#if QM_FORK
+/*
+ * Renders the documents in worker processes, which inherit the library
+ * when they are forked, so it is only loaded once. The workers take the
+ * next document from a shared counter until all are done. Each worker
+ * renders a document on its own, so the blocks aren't split up any further,
+ * and the statistics of the workers are not reported.
+ */
+static bool
+batch_fork(struct qm_library *library, struct qm_options *options)
+{
+	u32 *next_document = mmap(0, sizeof(*next_document),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (next_document == MAP_FAILED) {
+		return false;
+	}
+
+	struct qm_options worker_options = *options;
+	worker_options.jobs = 1;
+	u32 worker_count = MIN(options->jobs, options->document_count);
+	*next_document = 0;
+
+	/* NOTE: the buffered output would be written by every worker. */
+	fflush(stdout);
+	fflush(stderr);
+
+	u32 started = 0;
+	while (started < worker_count) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			break;
+		} else if (pid == 0) {
+			bool result = true;
+			u32 i;
+			while ((i = __atomic_fetch_add(next_document, 1,
+					__ATOMIC_RELAXED)) < options->document_count) {
+				result &= batch_render(library, &worker_options,
+					&options->documents[i]);
+			}
+
+			render_cache_save();
+			fflush(stderr);
+			_exit(!result);
+		}
+
+		started++;
+	}
+
+	/* NOTE: the remaining documents are rendered here if no worker started. */
+	bool result = true;
+	if (started == 0) {
+		u32 i;
+		while ((i = (*next_document)++) < options->document_count) {
+			result &= batch_render(library, &worker_options,
+				&options->documents[i]);
+		}
+	}
+
+	for (u32 i = 0; i < started; i++) {
+		int status;
+		if (wait(&status) < 0 || !WIFEXITED(status) ||
+				WEXITSTATUS(status) != 0) {
+			result = false;
+		}
+	}
+
+	munmap(next_document, sizeof(*next_document));
+	return result;
+}
+#endif
+
+static bool
+batch_run(struct qm_library *library, struct qm_options *options)
+{
+#if QM_FORK
+	if (options->jobs > 1 && options->document_count > 1) {
+		return batch_fork(library, options);
+	}
+#endif
+
+	bool result = true;
+	for (u32 i = 0; i < options->document_count; i++) {
+		result &= batch_render(library, options, &options->documents[i]);
+	}
+
+	return result;
+}
+
+static void
+library_report(struct qm_library *library, struct qm_options *options)
+{
+	if (options->memo_stats) {
+		fprintf(stderr, "memo: %llu hits, %llu misses\n",
+			(unsigned long long)library->memo.hits,
+			(unsigned long long)library->memo.misses);
+	}
+
+	if (options->stats) {
+		struct qm_cache_stats *cache_stats = 0;
+		if (render_cache.is_enabled) {
+			cache_stats = &render_cache.stats;
+		}
+
+		stats_report(stderr, options->stats_json, &library->parser.operators,
+			&library->env, cache_stats);
+	}
+}
+int
+main(int argc, char **argv)
+{
+	struct qm_json_scanner json = {0};
+	struct qm_buffer document = {0};
+	struct qm_library library = {0};
+	struct qm_output output = {0};
+	struct qm_options options = {0};
+
+	if (!options_parse(&options, argc, argv)) {
+		fprintf(stderr, "usage: %s [--memo | --memo-stats] [--huge-pages] "
+			"[--stats[=json]] [--flush=block|buffer] [-j threads] "
+			"[-i file.json | --server | --socket path] "
+			"[--cache macros.qmc] [--render-cache dir] "
+			"[--render-cache-size bytes[K|M|G]] macros.qm\n"
+			"       %s [options] macros.qm --batch in.json:out.json...\n"
+			"       %s [options] macros.qm --manifest file\n"
+			"       %s --compile macros.qm -o macros.qmc\n"
+			"The pairs of a batch can come before or after --batch. They are "
+			"split at the\nlast ':', so only the input path can contain one.\n",
+			argv[0], argv[0], argv[0], argv[0]);
+		options_finish(&options);
+		return 1;
+	}
+
+#if QM_ARENA_MMAP
+	arena_huge_pages = options.huge_pages;
+#endif
+
+	char_class_init();
+	if (!library_load(&library, &options)) {
+		library_finish(&library);
+		options_finish(&options);
+		return 1;
+	}
+
+	if (options.compile) {
+		u32 error_count = library.parser.error_count;
+		library_finish(&library);
+		options_finish(&options);
+		return error_count > 0;
+	}
+
+	if (options.render_cache_path && !render_cache_open(
+			options.render_cache_path, options.render_cache_size)) {
+		library_finish(&library);
+		options_finish(&options);
+		return 1;
+	}
+
+	if (options.batch) {
+		bool result = library.parser.error_count == 0;
+		result &= batch_run(&library, &options);
+		render_cache_finish();
+		library_report(&library, &options);
+		library_finish(&library);
+		options_finish(&options);
+		return !result;
+	}
+
+#if QM_SERVER
+	if (options.server) {
+		bool result = server_run(&library, &options);
+		render_cache_finish();
+		library_report(&library, &options);
+		library_finish(&library);
+		return !result;
+	}
+#endif
+
+	/* NOTE: the document is streamed if it can't be mapped. */
+	const char *input_name = options.input_path ? options.input_path : "stdin";
+	if (file_map(options.input_path, &document, false)) {
+		json.input.data = document.data;
+		json.input.size = document.size;
+	} else if (!options.input_path) {
+		json.input.file = stdin;
+	} else if (!(json.input.file = fopen(options.input_path, "r"))) {
+		fprintf(stderr, "Failed to read file '%s': %s\n", input_name,
+			strerror(errno));
+		render_cache_finish();
+		library_finish(&library);
+		return 1;
+	}
+
+	output.file = stdout;
+	library_eval(&library, &json, &output, &library.env, &options);
+
+	u32 error_count = library.parser.error_count;
+	if (json.input.file && ferror(json.input.file)) {
+		fprintf(stderr, "Failed to read %s: %s\n", input_name, strerror(errno));
+		error_count++;
+	}
+
+	output_finish(&output);
+	render_cache_finish();
+	library_report(&library, &options);
+
+	if (json.input.file && json.input.file != stdin) {
+		fclose(json.input.file);
+	}
+
+	pandoc_finish(&json);
+	file_close(&document);
+	library_finish(&library);
+	return error_count > 0;
+}
@@ -0,0 +1,349 @@
+/*
+ * Cache for the results of calls to pure functions, keyed by the function
+ * and the structure of its argument. A function is pure if all of its free
+ * variables are globals which are never used as the name of a parameter,
+ * since those cannot be captured by the dynamic scope of a caller, and if all
+ * functions bound to them are pure themselves.
+ *
+ * Any definition can change the result of a call, so the cache and the
+ * purity of the functions are only valid for one version of the environment.
+ * The memory of the arguments and results is kept until the end, since the
+ * values of earlier statements can still refer to it.
+ *
+ * Concatenations are compared by the string they render to, so they are
+ * interchangeable with the raw string and are stored flattened.
+ *
+ * The cache is off by default, since it only pays off when the same calls are
+ * repeated. A hit saves the evaluation of the body, while a miss still costs
+ * the hash of the argument and a probe. Short leaves are never cached and a
+ * call is only copied into the cache once it was seen before, so documents
+ * whose calls are all different run about as fast as without the cache.
+ */
+
+#define TEX_MEMO_MIN_OPS 64
+#define TEX_MEMO_SEEN_SIZE (1 << 14)
+
+static bool
+tex_render_equals(struct tex_value *a, struct tex_value *b)
+{
+	struct qm_output buffer_a = {0};
+	struct qm_output buffer_b = {0};
+	tex_value_write(a, &buffer_a);
+	tex_value_write(b, &buffer_b);
+
+	bool is_equal = buffer_a.used == buffer_b.used &&
+		memcmp(buffer_a.data, buffer_b.data, buffer_a.used) == 0;
+	output_finish(&buffer_a);
+	output_finish(&buffer_b);
+	return is_equal;
+}
+
+static bool
+tex_value_hash(struct tex_value *value, u32 *h)
+{
+	u32 type = value->type;
+	if (type == TEX_VALUE_CONCAT) {
+		type = TEX_VALUE_RAW_STRING;
+	}
+
+	*h = (*h ^ type) * 16777619;
+
+	switch (value->type) {
+	case TEX_VALUE_NUMBER:
+		*h = (*h ^ (u32)value->number) * 16777619;
+		break;
+	case TEX_VALUE_STRING:
+	case TEX_VALUE_RAW_STRING:
+		*h ^= hash(value->string.data, value->string.size);
+		*h *= 16777619;
+		break;
+	case TEX_VALUE_CONCAT:
+		{
+			struct qm_output buffer = {0};
+			tex_value_write(value, &buffer);
+			*h ^= hash(buffer.data, buffer.used);
+			*h *= 16777619;
+			output_finish(&buffer);
+		}
+		break;
+	case TEX_VALUE_MATRIX:
+		{
+			u32 count = value->matrix.width * value->matrix.height;
+			*h = (*h ^ value->matrix.width) * 16777619;
+			*h = (*h ^ value->matrix.height) * 16777619;
+			*h = (*h ^ value->matrix.delimiter) * 16777619;
+			for (u32 i = 0; i < count; i++) {
+				if (!tex_value_hash(&value->matrix.values[i], h)) {
+					return false;
+				}
+			}
+		}
+		break;
+	default:
+		/*
+		 * NOTE: functions can depend on the dynamic scope of the call, so
+		 * arguments which contain functions are not cached.
+		 */
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+tex_value_equals(struct tex_value *a, struct tex_value *b)
+{
+	bool is_concat = a->type == TEX_VALUE_CONCAT || b->type == TEX_VALUE_CONCAT;
+	bool is_raw = (a->type == TEX_VALUE_CONCAT || a->type == TEX_VALUE_RAW_STRING) &&
+		(b->type == TEX_VALUE_CONCAT || b->type == TEX_VALUE_RAW_STRING);
+	if (is_concat) {
+		return is_raw && tex_render_equals(a, b);
+	}
+
+	if (a->type != b->type) {
+		return false;
+	}
+
+	switch (a->type) {
+	case TEX_VALUE_NUMBER:
+		return a->number == b->number;
+	case TEX_VALUE_STRING:
+	case TEX_VALUE_RAW_STRING:
+		return a->string.size == b->string.size &&
+			memcmp(a->string.data, b->string.data, a->string.size) == 0;
+	case TEX_VALUE_MATRIX:
+		{
+			if (a->matrix.width != b->matrix.width ||
+					a->matrix.height != b->matrix.height ||
+					a->matrix.delimiter != b->matrix.delimiter) {
+				return false;
+			}
+
+			u32 count = a->matrix.width * a->matrix.height;
+			for (u32 i = 0; i < count; i++) {
+				if (!tex_value_equals(&a->matrix.values[i], &b->matrix.values[i])) {
+					return false;
+				}
+			}
+		}
+		return true;
+	case TEX_VALUE_FUNCTION:
+		return a->function.code == b->function.code;
+	default:
+		return false;
+	}
+}
+
+static void
+tex_value_copy(struct tex_value *dst, struct tex_value *src,
+		struct qm_memory_arena *arena)
+{
+	*dst = *src;
+
+	switch (src->type) {
+	case TEX_VALUE_CONCAT:
+		tex_value_flatten(dst, arena);
+		break;
+	case TEX_VALUE_STRING:
+	case TEX_VALUE_RAW_STRING:
+		dst->string.data = arena_alloc(arena, src->string.size, u8);
+		memcpy(dst->string.data, src->string.data, src->string.size);
+		break;
+	case TEX_VALUE_MATRIX:
+		{
+			u32 count = src->matrix.width * src->matrix.height;
+			dst->matrix.values = arena_alloc(arena, count, struct tex_value);
+			for (u32 i = 0; i < count; i++) {
+				tex_value_copy(&dst->matrix.values[i], &src->matrix.values[i],
+					arena);
+			}
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static bool
+tex_is_pure(struct tex_code *code, struct tex_environment *env)
+{
+	if (code->purity != TEX_PURITY_UNKNOWN &&
+			code->purity_version == env->version) {
+		return code->purity != TEX_PURITY_IMPURE;
+	}
+
+	/* NOTE: recursive functions are pure if the rest of the body is pure. */
+	code->purity = TEX_PURITY_PENDING;
+	code->purity_version = env->version;
+
+	bool is_pure = true;
+	bool is_leaf = true;
+	for (u32 ip = 0; is_pure && ip < code->op_count;) {
+		u32 op = code->ops[ip];
+		if (op == TEX_OP_NAME) {
+			u32 name = code->ops[ip + 1];
+			struct tex_value value;
+
+			if (symbol_flags(name) & QM_SYMBOL_PARAMETER) {
+				is_pure = false;
+			} else if (tex_env_find(env, name, &value) &&
+					value.type == TEX_VALUE_FUNCTION) {
+				is_pure = tex_is_pure(value.function.code, env);
+				is_leaf = false;
+			}
+		}
+
+		ip += 1 + tex_operand_count[op];
+	}
+
+	code->purity = is_pure ? TEX_PURITY_PURE : TEX_PURITY_IMPURE;
+	code->is_leaf = is_leaf;
+	return is_pure;
+}
+
+/*
+ * Returns whether the calls of the function should be cached. A lookup costs
+ * about as much as hashing and comparing the argument, and a miss also copies
+ * the argument and the result, while the body of a leaf only concatenates its
+ * parameters with constants. So leaves with short bodies are always run.
+ */
+static bool
+tex_is_memoizable(struct tex_code *code, struct tex_environment *env)
+{
+	return tex_is_pure(code, env) &&
+		(!code->is_leaf || code->op_count >= TEX_MEMO_MIN_OPS);
+}
+
+static void
+tex_memo_flush(struct tex_memo *memo, struct tex_environment *env)
+{
+	if (memo->used > 0) {
+		memset(memo->entries, 0, memo->size * sizeof(*memo->entries));
+		memo->used = 0;
+	}
+
+	memo->version = env->version;
+}
+
+static struct tex_memo_entry *
+tex_memo_slot(struct tex_memo *memo, struct tex_code *code,
+		struct tex_value *arg, u32 h)
+{
+	u32 mask = memo->size - 1;
+	u32 i = h & mask;
+
+	while (memo->entries[i].code) {
+		struct tex_memo_entry *entry = &memo->entries[i];
+		if (entry->code == code && entry->hash == h &&
+				tex_value_equals(&entry->arg, arg)) {
+			break;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	return &memo->entries[i];
+}
+
+static bool
+tex_memo_find(struct tex_memo *memo, struct tex_code *code,
+		struct tex_value *arg, u32 h, struct tex_value *result)
+{
+	if (memo->size == 0) {
+		memo->misses++;
+		return false;
+	}
+
+	struct tex_memo_entry *entry = tex_memo_slot(memo, code, arg, h);
+	if (entry->code) {
+		*result = entry->result;
+		memo->hits++;
+		return true;
+	} else {
+		memo->misses++;
+		return false;
+	}
+}
+
+static void
+tex_memo_insert(struct tex_memo *memo, struct tex_code *code,
+		struct tex_value *arg, u32 h, struct tex_value *result)
+{
+	/*
+	 * NOTE: most calls are never repeated and copying them costs more than
+	 * running them, so a call is only cached when it misses the second time.
+	 * Two calls with the same hash are admitted early, which is harmless.
+	 */
+	if (!memo->seen) {
+		memo->seen = calloc(TEX_MEMO_SEEN_SIZE, sizeof(*memo->seen));
+		if (!memo->seen) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	u32 *seen = &memo->seen[h & (TEX_MEMO_SEEN_SIZE - 1)];
+	if (*seen != h) {
+		*seen = h;
+		return;
+	}
+
+	if (2 * (memo->used + 1) > memo->size) {
+		u32 old_size = memo->size;
+		struct tex_memo_entry *old_entries = memo->entries;
+
+		memo->size = MAX(2 * old_size, 1024);
+		memo->entries = calloc(memo->size, sizeof(*memo->entries));
+		if (!memo->entries) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+
+		u32 mask = memo->size - 1;
+		for (u32 j = 0; j < old_size; j++) {
+			if (old_entries[j].code) {
+				u32 i = old_entries[j].hash & mask;
+				while (memo->entries[i].code) {
+					i = (i + 1) & mask;
+				}
+
+				memo->entries[i] = old_entries[j];
+			}
+		}
+
+		free(old_entries);
+	}
+
+	struct tex_memo_entry *entry = tex_memo_slot(memo, code, arg, h);
+	if (!entry->code) {
+		entry->code = code;
+		entry->hash = h;
+		tex_value_copy(&entry->arg, arg, &memo->arena);
+		tex_value_copy(&entry->result, result, &memo->arena);
+		memo->used++;
+	}
+}
+
+static void
+tex_memo_finish(struct tex_memo *memo)
+{
+	free(memo->entries);
+	free(memo->seen);
+	arena_finish(&memo->arena);
+}
+
+/*
+ * Forgets all results and frees their memory, e.g. when the code of a
+ * document which was called is freed. The statistics are kept.
+ */
+static void
+tex_memo_reset(struct tex_memo *memo)
+{
+	tex_memo_finish(memo);
+	memo->arena = (struct qm_memory_arena){0};
+	memo->entries = 0;
+	memo->seen = 0;
+	memo->used = 0;
+	memo->size = 0;
+	memo->version = 0;
+}
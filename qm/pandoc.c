@@ -1,79 +1,327 @@
+/*
+ * The document is read in chunks into a window, which only has to hold the
+ * current string. Everything which was scanned is written to the output
+ * before the window is refilled, so the memory doesn't depend on the size of
+ * the document, only on the size of the largest math string.
+ */
+
+#ifndef PANDOC_CHUNK_SIZE
+#define PANDOC_CHUNK_SIZE (1 << 16)
+#endif
+
+static void
+pandoc_flush(struct qm_stream *input, struct qm_output *output)
+{
+	if (input->at > input->start) {
+		output_slice(output, input->data + input->start,
+			input->at - input->start);
+		input->start = input->at;
+	}
+}
+
+/*
+ * Makes at least count bytes available after the cursor. Returns false if
+ * the input ends before.
+ */
 static bool
-pandoc_next_string(struct qm_buffer *input)
+pandoc_fill(struct qm_stream *input, struct qm_output *output, usize count)
 {
-	u8 *at = input->data + input->start;
-	u32 length = input->size - input->start;
-
-	if (*at == '"') {
-		do {
-			if (*at == '\\') {
-				at++;
-				length--;
+	if (input->size - input->at >= count) {
+		return true;
+	} else if (!input->file || input->is_eof) {
+		return false;
+	}
+
+	/* NOTE: the slices of the window are copied before it is moved. */
+	pandoc_flush(input, output);
+	output_unslice(output);
+	usize keep = input->size - input->start;
+	if (keep > 0) {
+		memmove(input->data, input->data + input->start, keep);
+	}
+
+	input->offset += input->start;
+	input->size = keep;
+	input->at = 0;
+	input->start = 0;
+
+	while (input->size < count && !input->is_eof) {
+		usize needed = MAX(count, input->size + PANDOC_CHUNK_SIZE);
+		if (needed > input->capacity) {
+			input->capacity = MAX(2 * input->capacity, needed);
+			if (!(input->data = realloc(input->data, input->capacity))) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
 			}
+		}
 
-			at++;
-			length--;
-		} while (length > 0 && *at != '"');
+		usize n = fread(input->data + input->size, 1,
+			input->capacity - input->size, input->file);
+		input->size += n;
+		input->is_eof = n == 0;
+	}
 
-		if (length == 0) {
-			return false;
+	return input->size >= count;
+}
+
+/*
+ * The scanner works in two stages like simdjson. The first stage classifies
+ * 64 bytes at once and records the offsets of the structural characters:
+ * the quotes which start or end a string, and the brackets, colons and
+ * commas outside of strings. A quote is escaped if it follows an odd number
+ * of backslashes, and a byte is inside of a string if an odd number of
+ * unescaped quotes precede it, both of which can carry over from the
+ * previous block. The second stage walks the objects and arrays along these
+ * offsets and finds the math nodes by their structure:
+ *
+ *     {"t": "Math", "c": [{"t": "DisplayMath"}, "..."]}
+ *
+ * The keys can appear in any order, so the math string is held back in the
+ * window until its node is closed. The bytes around it are passed through
+ * verbatim.
+ */
+#define PANDOC_BLOCK_SIZE 64
+
+/* Returns the mask of the structural characters in the block. */
+static u64
+pandoc_scan_block(struct qm_json_scanner *json, const u8 *at)
+{
+	u64 quotes = 0;
+	u64 backslashes = 0;
+	u64 operators = 0;
+
+#ifdef QM_SIMD_WIDTH
+	for (u32 i = 0; i < PANDOC_BLOCK_SIZE; i += QM_SIMD_WIDTH) {
+		qm_simd v = simd_load(at + i);
+
+		/* NOTE: [ and ] only differ from { and } in the 0x20 bit. */
+		qm_simd lower = simd_or(v, simd_set1(0x20));
+		qm_simd brackets = simd_or(simd_eq(lower, simd_set1('{')),
+			simd_eq(lower, simd_set1('}')));
+		qm_simd separators = simd_or(simd_eq(v, simd_set1(':')),
+			simd_eq(v, simd_set1(',')));
+
+		quotes |= (u64)simd_movemask(simd_eq(v, simd_set1('"'))) << i;
+		backslashes |= (u64)simd_movemask(simd_eq(v, simd_set1('\\'))) << i;
+		operators |= (u64)simd_movemask(simd_or(brackets, separators)) << i;
+	}
+#else
+	for (u32 i = 0; i < PANDOC_BLOCK_SIZE; i++) {
+		u8 c = at[i];
+		quotes |= (u64)(c == '"') << i;
+		backslashes |= (u64)(c == '\\') << i;
+		operators |= (u64)(c == '{' || c == '}' || c == '[' || c == ']' ||
+			c == ':' || c == ',') << i;
+	}
+#endif
+
+	/* NOTE: each backslash which is not escaped escapes the next byte. */
+	u64 escaped = json->escape_carry;
+	u64 escapes = backslashes & ~escaped;
+	json->escape_carry = 0;
+	while (escapes) {
+		u32 i = __builtin_ctzll(escapes);
+		if (i == PANDOC_BLOCK_SIZE - 1) {
+			json->escape_carry = 1;
+			break;
 		}
 
-		length--;
-		at++;
+		escaped |= (u64)1 << (i + 1);
+		escapes &= ~((u64)3 << i);
 	}
 
-	while (length > 0 && *at != '"') {
-		length--;
-		at++;
+	/* NOTE: the prefix xor sets the bits from each opening quote. */
+	quotes &= ~escaped;
+	u64 in_string = quotes;
+	for (u32 shift = 1; shift < PANDOC_BLOCK_SIZE; shift *= 2) {
+		in_string ^= in_string << shift;
 	}
 
-	input->start = at - input->data;
-	return *at == '"';
+	in_string ^= json->string_carry;
+	json->string_carry = 0 - (in_string >> 63);
+	return quotes | (operators & ~in_string);
 }
 
+/*
+ * Records the structural characters of the next part of the input. Returns
+ * false if the whole input was scanned.
+ */
 static bool
-pandoc_key_equals(struct qm_buffer *input, char *key)
+pandoc_index(struct qm_json_scanner *json, struct qm_output *output)
 {
-	u8 *at = input->data + input->start + 1;
-	u32 length = input->size - input->start;
-	u32 key_length = strlen(key);
+	struct qm_stream *input = &json->input;
+
+	u32 remaining = json->index_count - json->index_at;
+	if (remaining > 0) {
+		memmove(json->indexes, json->indexes + json->index_at,
+			remaining * sizeof(*json->indexes));
+	}
+	json->index_count = remaining;
+	json->index_at = 0;
 
-	if (key_length + 2 <= length && memcmp(at, key, key_length) == 0) {
-		return at[key_length + 1] == ':';
-	} else {
+	usize offset = json->scanned - input->offset - input->at;
+	pandoc_fill(input, output, offset + PANDOC_BLOCK_SIZE);
+	usize pos = input->at + offset;
+	if (pos == input->size) {
 		return false;
 	}
+
+	usize needed = json->index_count + PANDOC_CHUNK_SIZE + PANDOC_BLOCK_SIZE;
+	if (needed > json->index_capacity) {
+		json->index_capacity = needed;
+		json->indexes = realloc(json->indexes,
+			json->index_capacity * sizeof(*json->indexes));
+		if (!json->indexes) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* NOTE: the last block is padded with zeros at the end of the input. */
+	bool is_end = !input->file || input->is_eof;
+	usize end = MIN(input->size, pos + PANDOC_CHUNK_SIZE);
+	while (pos < end) {
+		usize available = input->size - pos;
+		const u8 *block = input->data + pos;
+		u8 tail[PANDOC_BLOCK_SIZE];
+		if (available < PANDOC_BLOCK_SIZE) {
+			if (!is_end) {
+				break;
+			}
+
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, block, available);
+			block = tail;
+		}
+
+		u64 mask = pandoc_scan_block(json, block);
+		while (mask) {
+			json->indexes[json->index_count++] = input->offset + pos +
+				__builtin_ctzll(mask);
+			mask &= mask - 1;
+		}
+
+		pos += MIN(available, PANDOC_BLOCK_SIZE);
+	}
+
+	json->scanned = input->offset + pos;
+	return true;
+}
+
+static bool
+pandoc_next_index(struct qm_json_scanner *json, struct qm_output *output,
+		u64 *index)
+{
+	while (json->index_at == json->index_count) {
+		if (!pandoc_index(json, output)) {
+			return false;
+		}
+	}
+
+	*index = json->indexes[json->index_at++];
+	return true;
 }
 
+/* Compares the string between the quotes at the given offsets. */
 static bool
-pandoc_string_equals(struct qm_buffer *input, char *str)
+pandoc_string_equals(struct qm_stream *input, u64 start, u64 end, char *str)
 {
-	u8 *at = input->data + input->start + 1;
-	u32 length = input->size - input->start;
-	u32 str_length = strlen(str);
+	usize length = strlen(str);
+	return end - start - 1 == length &&
+		memcmp(input->data + (start + 1 - input->offset), str, length) == 0;
+}
 
-	return str_length <= length + 2 && memcmp(at, str, str_length) == 0;
+static void
+pandoc_push(struct qm_json_scanner *json, u32 flags)
+{
+	if (json->depth == json->frame_capacity) {
+		json->frame_capacity = MAX(2 * json->frame_capacity, 64);
+		json->frames = realloc(json->frames,
+			json->frame_capacity * sizeof(*json->frames));
+		if (!json->frames) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	struct qm_json_frame *frame = &json->frames[json->depth++];
+	frame->flags = flags;
+	frame->index = 0;
 }
 
-static u32
-pandoc_string_length(struct qm_buffer *input)
+static void
+pandoc_string(struct qm_json_scanner *json, u64 start, u64 end)
 {
-	u8 *at = input->data + input->start + 1;
-	u32 length = 1;
+	struct qm_stream *input = &json->input;
+	if (json->depth == 0) {
+		return;
+	}
 
-	assert(*at != '"');
-	while (*at != '"') {
-		if (*at == '\\') {
-			length++;
-			at++;
+	struct qm_json_frame *frame = &json->frames[json->depth - 1];
+	if (frame->flags & QM_JSON_OBJECT) {
+		if (frame->flags & QM_JSON_EXPECT_KEY) {
+			if (pandoc_string_equals(input, start, end, "t")) {
+				frame->flags |= QM_JSON_KEY_T;
+			} else if (pandoc_string_equals(input, start, end, "c")) {
+				frame->flags |= QM_JSON_KEY_C;
+			}
+		} else if (frame->flags & QM_JSON_KEY_T) {
+			if (pandoc_string_equals(input, start, end, "Math")) {
+				frame->flags |= QM_JSON_IS_MATH;
+			} else if (pandoc_string_equals(input, start, end, "DisplayMath") ||
+					pandoc_string_equals(input, start, end, "InlineMath")) {
+				frame->flags |= QM_JSON_IS_MATH_TYPE;
+			}
 		}
+	} else if ((frame->flags & QM_JSON_IS_CONTENT) &&
+			(frame->flags & QM_JSON_HAS_MATH_TYPE) && frame->index == 1 &&
+			!json->has_math) {
+		/* NOTE: math nodes can't contain other nodes. */
+		frame->flags |= QM_JSON_HAS_MATH_STRING;
+		json->has_math = true;
+		json->math_frame = json->depth - 2;
+		json->math_start = start;
+		json->math_end = end;
+	}
+}
 
-		length++;
-		at++;
+/* Returns true if the object was a math node. */
+static bool
+pandoc_close(struct qm_json_scanner *json)
+{
+	if (json->depth == 0) {
+		return false;
+	}
+
+	struct qm_json_frame frame = json->frames[--json->depth];
+	struct qm_json_frame *parent = 0;
+	if (json->depth > 0) {
+		parent = &json->frames[json->depth - 1];
 	}
 
-	return length + 1;
+	if (frame.flags & QM_JSON_OBJECT) {
+		if (json->has_math && json->math_frame == json->depth) {
+			u32 math_flags = QM_JSON_IS_MATH | QM_JSON_HAS_CONTENT;
+			if ((frame.flags & math_flags) == math_flags) {
+				return true;
+			}
+
+			json->has_math = false;
+		}
+
+		if (parent && (parent->flags & QM_JSON_IS_CONTENT) &&
+				parent->index == 0 && (frame.flags & QM_JSON_IS_MATH_TYPE)) {
+			parent->flags |= QM_JSON_HAS_MATH_TYPE;
+		}
+	} else if (frame.flags & QM_JSON_HAS_MATH_STRING) {
+		if (frame.index == 1) {
+			parent->flags |= QM_JSON_HAS_CONTENT;
+		} else {
+			json->has_math = false;
+		}
+	}
+
+	return false;
 }
 
 /* TODO: encode all characters that have to be encoded */
@@ -81,9 +329,9 @@ static usize
 pandoc_encode_string(u8 *string, u8 *encoded_string)
 {
 	u8 *at = string + 1;
-	u32 count = 0;
+	usize count = 0;
 
-	do {
+	while (*at != '"') {
 		u8 c = *at;
 		if (c == '\\') {
 			at++;
@@ -101,92 +349,115 @@ pandoc_encode_string(u8 *string, u8 *encoded_string)
 
 		at++;
 		count++;
-	} while (*at != '"');
+	}
 
 	return count;
 }
 
 /*
- * NOTE: this is by no means a complete json parser. All it does is iterate
- * over json strings and tries to match those with a pattern that matches
- * inline and display math elements from the pandoc json format. This should
- * probably be replaced by a proper json parser or something similar.
+ * Returns true if a math block was found and false at the end of the input.
+ * With a limit, it also returns false once the pass-through holds at least
+ * that many bytes, so that the caller can write them before it continues.
  */
 static bool
-pandoc_next_math_block(struct qm_buffer *input, struct qm_memory_arena *arena,
-		struct qm_buffer *output)
+pandoc_next_math_block(struct qm_json_scanner *json,
+		struct qm_memory_arena *arena, struct qm_buffer *output,
+		struct qm_output *passthrough, usize limit)
 {
-	u32 start = input->start;
-	u32 state = 0;
-	while (state < 6 && pandoc_next_string(input)) {
-		switch (state) {
-		case 0:
-		case 3:
-			if (pandoc_key_equals(input, "t")) {
-				state++;
-			} else {
-				state = 0;
+	struct qm_stream *input = &json->input;
+
+	u64 index;
+	while (pandoc_next_index(json, passthrough, &index)) {
+		/* NOTE: everything before the current character can be written. */
+		if (!json->has_math) {
+			input->at = index - input->offset;
+		}
+
+		struct qm_json_frame *frame = 0;
+		if (json->depth > 0) {
+			frame = &json->frames[json->depth - 1];
+		}
+
+		switch (input->data[index - input->offset]) {
+		case '{':
+			pandoc_push(json, QM_JSON_OBJECT | QM_JSON_EXPECT_KEY);
+			break;
+		case '[':
+			{
+				u32 flags = 0;
+				if (frame && (frame->flags & QM_JSON_OBJECT) &&
+						!(frame->flags & QM_JSON_EXPECT_KEY) &&
+						(frame->flags & QM_JSON_KEY_C)) {
+					flags = QM_JSON_IS_CONTENT;
+				}
+
+				pandoc_push(json, flags);
 			}
 			break;
-		case 1:
-			if (pandoc_string_equals(input, "Math")) {
-				state++;
-			} else {
-				state = 0;
+		case ':':
+			if (frame) {
+				frame->flags &= ~QM_JSON_EXPECT_KEY;
 			}
 			break;
-		case 2:
-			if (pandoc_key_equals(input, "c")) {
-				state++;
-			} else {
-				state = 0;
+		case ',':
+			if (frame && (frame->flags & QM_JSON_OBJECT)) {
+				frame->flags &= ~(QM_JSON_KEY_T | QM_JSON_KEY_C);
+				frame->flags |= QM_JSON_EXPECT_KEY;
+			} else if (frame) {
+				frame->index++;
 			}
 			break;
-		case 4:
-			if (pandoc_string_equals(input, "DisplayMath") ||
-					pandoc_string_equals(input, "InlineMath")) {
-				state++;
-			} else {
-				state = 0;
+		case '"':
+			{
+				u64 end;
+				if (!pandoc_next_index(json, passthrough, &end)) {
+					break;
+				}
+
+				pandoc_string(json, index, end);
 			}
 			break;
-		case 5:
-			state += 1;
-			output->start = 0;
-			output->size = pandoc_encode_string(input->data + input->start, 0);
-			output->data = arena_alloc(arena, output->size + 1, u8);
-			pandoc_encode_string(input->data + input->start, output->data);
-			output->data[output->size] = '\0';
+		case '}':
+		case ']':
+			if (pandoc_close(json)) {
+				usize start = json->math_start - input->offset;
+				usize end = json->math_end - input->offset;
+				json->has_math = false;
+
+				output->start = 0;
+				output->size = pandoc_encode_string(input->data + start, 0);
+				output->data = arena_alloc(arena, output->size + 1, u8);
+				pandoc_encode_string(input->data + start, output->data);
+				output->data[output->size] = '\0';
+
+				/* NOTE: the string is replaced by the output of the block. */
+				input->at = start;
+				pandoc_flush(input, passthrough);
+				input->at = end + 1;
+				input->start = input->at;
+				return true;
+			}
 			break;
 		}
-	}
 
-	u32 count = input->start - start;
-	fwrite(input->data + start, count, 1, stdout);
-	if (state == 6) {
-		input->start += pandoc_string_length(input);
+		if (limit && passthrough->used + (input->at - input->start) >= limit) {
+			pandoc_flush(input, passthrough);
+			return false;
+		}
 	}
 
-	return state == 6;
+	input->at = input->size;
+	pandoc_flush(input, passthrough);
+	return false;
 }
 
 static void
-pandoc_print_string(u8 *string, usize size)
+pandoc_finish(struct qm_json_scanner *json)
 {
-	u8 *at = string;
-
-	while (size > 0) {
-		if (*at == '"') {
-			printf("\\\"");
-		} else if (*at == '\n') {
-			printf("\\\n");
-		} else if (*at == '\\') {
-			printf("\\\\");
-		} else {
-			putchar(*at);
-		}
-
-		size--;
-		at++;
+	if (json->input.file) {
+		free(json->input.data);
 	}
+
+	free(json->indexes);
+	free(json->frames);
 }
@@ -1,73 +1,328 @@
-static const u8 *open_delimiters[2][QM_TOKEN_COUNT] = {
+static const struct qm_string open_delimiters[2][QM_TOKEN_COUNT] = {
 	[false] = {
-		[QM_TOKEN_LPAREN]   = (u8 *)"(",
-		[QM_TOKEN_LBRACKET] = (u8 *)"_{",
-		[QM_TOKEN_LBRACE]   = (u8 *)"\\{",
+		[QM_TOKEN_LPAREN]   = QM_STRING("("),
+		[QM_TOKEN_LBRACKET] = QM_STRING("_{"),
+		[QM_TOKEN_LBRACE]   = QM_STRING("\\{"),
 	},
 	[true] = {
-		[QM_TOKEN_LPAREN]   = (u8 *)"\\begin{pmatrix}",
-		[QM_TOKEN_LBRACKET] = (u8 *)"\\begin{bmatrix}",
-		[QM_TOKEN_LBRACE]   = (u8 *)"\\begin{matrix}",
+		[QM_TOKEN_LPAREN]   = QM_STRING("\\begin{pmatrix}"),
+		[QM_TOKEN_LBRACKET] = QM_STRING("\\begin{bmatrix}"),
+		[QM_TOKEN_LBRACE]   = QM_STRING("\\begin{matrix}"),
 	},
 };
 
-static const u8 *closing_delimiters[2][QM_TOKEN_COUNT] = {
+static const struct qm_string closing_delimiters[2][QM_TOKEN_COUNT] = {
 	[false] = {
-		[QM_TOKEN_LPAREN]   = (u8 *)")",
-		[QM_TOKEN_LBRACKET] = (u8 *)"}",
-		[QM_TOKEN_LBRACE]   = (u8 *)"\\}",
+		[QM_TOKEN_LPAREN]   = QM_STRING(")"),
+		[QM_TOKEN_LBRACKET] = QM_STRING("}"),
+		[QM_TOKEN_LBRACE]   = QM_STRING("\\}"),
 	},
 	[true] = {
-		[QM_TOKEN_LPAREN]   = (u8 *)"\\end{pmatrix}",
-		[QM_TOKEN_LBRACKET] = (u8 *)"\\end{bmatrix}",
-		[QM_TOKEN_LBRACE]   = (u8 *)"\\end{matrix}",
+		[QM_TOKEN_LPAREN]   = QM_STRING("\\end{pmatrix}"),
+		[QM_TOKEN_LBRACKET] = QM_STRING("\\end{bmatrix}"),
+		[QM_TOKEN_LBRACE]   = QM_STRING("\\end{matrix}"),
 	},
 };
 
-static usize
-buffer_write(struct qm_buffer *buffer, const u8 *string)
+static const u32 tex_operand_count[TEX_OP_COUNT] = {
+	[TEX_OP_CONSTANT] = 1,
+	[TEX_OP_LOCAL]    = 1,
+	[TEX_OP_NAME]     = 1,
+	[TEX_OP_MATRIX]   = 3,
+	[TEX_OP_CALL]     = 0,
+	[TEX_OP_UNWRAP]   = 0,
+	[TEX_OP_SLIDE]    = 1,
+	[TEX_OP_RETURN]   = 0,
+};
+
+/*
+ * The output is collected in a buffer and written with one call per flush.
+ * Long runs of the input, which stay alive until the next flush, are not
+ * copied into the buffer, but gathered with writev as slices between the
+ * buffered bytes. Without writev, the slices are written one by one.
+ */
+static void
+output_write_file(FILE *file, const u8 *data, usize size)
 {
-	assert(string);
-
-	if (buffer) {
-		u8 *at = buffer->data + buffer->start;
-		u32 size = buffer->size;
-		u32 used = buffer->start;
-		u32 count = 0;
-		while (*string && used + count < size) {
-			*at++ = *string++;
-			count++;
+	if (size > 0) {
+		fwrite(data, size, 1, file);
+	}
+}
+
+#if QM_OUTPUT_WRITEV
+static void
+output_writev(int fd, struct iovec *iov, u32 count)
+{
+	while (count > 0) {
+		ssize_t n = writev(fd, iov, count);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			perror("writev");
+			exit(EXIT_FAILURE);
 		}
 
-		buffer->start += count;
-		return count;
-	} else {
-		return string_length(string);
+		while (count > 0 && (usize)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count > 0) {
+			iov->iov_base = (u8 *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
 	}
 }
+#endif
 
-static usize
-buffer_writen(struct qm_buffer *buffer, const u8 *string, u32 length)
+static void
+output_flush(struct qm_output *output)
 {
-	if (buffer) {
-		u8 *at = buffer->data + buffer->start;
-		u32 size = buffer->size;
-		u32 used = buffer->start;
-		u32 count = 0;
-		while (length-- > 0 && used + count < size) {
-			*at++ = *string++;
+	if (!output->file || (output->used == 0 && output->slice_count == 0)) {
+		return;
+	}
+
+#if QM_OUTPUT_WRITEV
+	struct iovec iov[2 * QM_OUTPUT_SLICES + 1];
+	u32 count = 0;
+	usize offset = 0;
+	for (u32 i = 0; i < output->slice_count; i++) {
+		struct qm_output_slice *slice = &output->slices[i];
+		if (slice->offset > offset) {
+			iov[count].iov_base = output->data + offset;
+			iov[count].iov_len = slice->offset - offset;
 			count++;
 		}
 
-		buffer->start += count;
-		return count;
+		iov[count].iov_base = (void *)slice->data;
+		iov[count].iov_len = slice->size;
+		offset = slice->offset;
+		count++;
+	}
+
+	if (output->used > offset) {
+		iov[count].iov_base = output->data + offset;
+		iov[count].iov_len = output->used - offset;
+		count++;
+	}
+
+	fflush(output->file);
+	output_writev(fileno(output->file), iov, count);
+#else
+	usize offset = 0;
+	for (u32 i = 0; i < output->slice_count; i++) {
+		struct qm_output_slice *slice = &output->slices[i];
+		output_write_file(output->file, output->data + offset,
+			slice->offset - offset);
+		output_write_file(output->file, slice->data, slice->size);
+		offset = slice->offset;
+	}
+
+	output_write_file(output->file, output->data + offset,
+		output->used - offset);
+#endif
+
+	output->used = 0;
+	output->slice_count = 0;
+}
+
+static void
+output_reserve(struct qm_output *output, usize size)
+{
+	if (output->used + size > output->size) {
+		output_flush(output);
+	}
+
+	if (output->used + size > output->size) {
+		usize new_size = MAX(output->size, 65536);
+		while (output->used + size > new_size) {
+			new_size *= 2;
+		}
+
+		if (!(output->data = realloc(output->data, new_size))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+
+		output->size = new_size;
+	}
+}
+
+static void
+output_finish(struct qm_output *output)
+{
+	output_flush(output);
+	free(output->data);
+	free(output->slices);
+	output->data = 0;
+	output->slices = 0;
+	output->size = output->used = 0;
+}
+
+/* Copies the bytes verbatim, regardless of the escape_json flag. */
+static void
+output_raw(struct qm_output *output, const u8 *string, usize length)
+{
+	if (length == 0) {
+		/* NOTE: a memory output has no buffer until something is written. */
+		return;
+	} else if (output->file && length >= output->size) {
+		output_flush(output);
+		output_write_file(output->file, string, length);
 	} else {
-		return length;
+		output_reserve(output, length);
+		memcpy(output->data + output->used, string, length);
+		output->used += length;
+	}
+}
+
+/*
+ * Writes the bytes verbatim like output_raw, but the bytes have to stay
+ * alive until the next flush, since long slices are not copied.
+ */
+static void
+output_slice(struct qm_output *output, const u8 *string, usize length)
+{
+	if (!output->file || length < QM_OUTPUT_SLICE_MIN) {
+		output_raw(output, string, length);
+		return;
+	}
+
+	if (!output->slices) {
+		output->slices = calloc(QM_OUTPUT_SLICES, sizeof(*output->slices));
+		if (!output->slices) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+	} else if (output->slice_count == QM_OUTPUT_SLICES) {
+		output_flush(output);
+	}
+
+	struct qm_output_slice *slice = &output->slices[output->slice_count++];
+	slice->data = string;
+	slice->size = length;
+	slice->offset = output->used;
+}
+
+/*
+ * Copies the slices into the buffer, so that the memory they refer to can
+ * be reused before the next flush. If they don't fit, the buffer is full
+ * and flushed instead.
+ */
+static void
+output_unslice(struct qm_output *output)
+{
+	usize size = output->used;
+	for (u32 i = 0; i < output->slice_count; i++) {
+		size += output->slices[i].size;
+	}
+
+	if (size > output->size) {
+		output_flush(output);
+		return;
+	}
+
+	/* NOTE: the bytes are moved back from the end, so nothing is overwritten. */
+	usize end = output->used;
+	usize at = size;
+	for (u32 i = output->slice_count; i-- > 0;) {
+		struct qm_output_slice *slice = &output->slices[i];
+		at -= end - slice->offset;
+		memmove(output->data + at, output->data + slice->offset,
+			end - slice->offset);
+		at -= slice->size;
+		memcpy(output->data + at, slice->data, slice->size);
+		end = slice->offset;
 	}
+
+	output->used = size;
+	output->slice_count = 0;
+}
+
+/* Returns the first byte in [at, end) which has to be escaped in JSON. */
+static const u8 *
+output_skip_clean(const u8 *at, const u8 *end)
+{
+#ifdef QM_SIMD_WIDTH
+	while (end - at >= QM_SIMD_WIDTH) {
+		/* NOTE: the xor turns the unsigned comparison into a signed one. */
+		qm_simd v = simd_load(at);
+		qm_simd control = simd_gt(simd_set1(0x20 ^ 0x80),
+			simd_xor(v, simd_set1(0x80)));
+		qm_simd special = simd_or(simd_eq(v, simd_set1('"')),
+			simd_eq(v, simd_set1('\\')));
+		u32 mask = simd_movemask(simd_or(control, special));
+		if (mask) {
+			return at + __builtin_ctz(mask);
+		}
+
+		at += QM_SIMD_WIDTH;
+	}
+#endif
+
+	while (at < end && *at != '"' && *at != '\\' && *at >= 0x20) {
+		at++;
+	}
+
+	return at;
 }
 
+static void
+output_writen(struct qm_output *output, const u8 *string, usize length)
+{
+	static const u8 hex[] = "0123456789abcdef";
+
+	if (!output->escape_json) {
+		output_raw(output, string, length);
+		return;
+	}
+
+	const u8 *end = string + length;
+	while (string < end) {
+		const u8 *clean_end = output_skip_clean(string, end);
+		output_raw(output, string, clean_end - string);
+		if (clean_end == end) {
+			break;
+		}
+
+		/* NOTE: a control character expands to six bytes. */
+		output_reserve(output, 6);
+		u8 *at = output->data + output->used;
+		u8 c = *clean_end;
+		if (c == '"' || c == '\\') {
+			*at++ = '\\';
+			*at++ = c;
+		} else if (c == '\n') {
+			*at++ = '\\';
+			*at++ = 'n';
+		} else {
+			*at++ = '\\';
+			*at++ = 'u';
+			*at++ = '0';
+			*at++ = '0';
+			*at++ = hex[c >> 4];
+			*at++ = hex[c & 15];
+		}
+
+		output->used = at - output->data;
+		string = clean_end + 1;
+	}
+}
+
+static void
+output_write(struct qm_output *output, struct qm_string string)
+{
+	output_writen(output, string.data, string.size);
+}
+
+#define output_literal(output, literal) \
+	output_writen(output, (const u8 *)(literal), sizeof(literal) - 1)
+
 static bool
-tex_env_find(struct tex_environment *env, const u8 *name, struct tex_value *value)
+tex_env_find(struct tex_environment *env, u32 name, struct tex_value *value)
 {
 	if (!name) {
 		return false;
@@ -75,9 +330,11 @@ tex_env_find(struct tex_environment *env, const u8 *name, struct tex_value *valu
 
 	u32 size = env->size;
 	u32 mask = size - 1;
-	u32 i = hash(name) & mask;
-	while (size-- > 0) {
-		if (string_equals(name, env->keys[i])) {
+	u32 h = symbol_hash(name);
+	u32 i = h & mask;
+	while (size-- > 0 && env->keys[i]) {
+		if (env->keys[i] == name) {
+			stats_probe(&env->probes, (i - h) & mask);
 			memcpy(value, &env->values[i], sizeof(*value));
 			assert(0 <= value->type && value->type < TEX_VALUE_COUNT);
 			return true;
@@ -86,43 +343,55 @@ tex_env_find(struct tex_environment *env, const u8 *name, struct tex_value *valu
 		i = (i + 1) & mask;
 	}
 
+	stats_probe(&env->probes, (i - h) & mask);
+
 	return env->parent ? tex_env_find(env->parent, name, value) : false;
 }
 
 static bool
 tex_env_define(struct tex_environment *env, struct qm_memory_arena *arena,
-		u8 *name, struct tex_value *value)
+		u32 name, struct tex_value *value)
 {
 	assert(0 <= value->type && value->type < TEX_VALUE_COUNT);
 
-	if (env->size == 0) {
-		env->size = 1024;
-		env->keys = arena_alloc(arena, env->size, u8 *);
+	if (2 * (env->used + 1) > env->size) {
+		u32 old_size = env->size;
+		u32 *old_keys = env->keys;
+		struct tex_value *old_values = env->values;
+
+		env->size = MAX(2 * old_size, 64);
+		env->keys = arena_alloc_zero(arena, env->size, u32);
 		env->values = arena_alloc(arena, env->size, struct tex_value);
-		memset(env->keys, 0, env->size * sizeof(*env->keys));
-		memset(env->values, 0, env->size * sizeof(*env->values));
-	}
 
-	// TODO: reallocate the environment map
-	if (env->used == env->size) {
-		return false;
-	}
+		u32 mask = env->size - 1;
+		for (u32 j = 0; j < old_size; j++) {
+			if (old_keys[j]) {
+				u32 i = symbol_hash(old_keys[j]) & mask;
+				while (env->keys[i]) {
+					i = (i + 1) & mask;
+				}
 
-	u32 size = env->size;
-	u32 mask = size - 1;
-	u32 i = hash(name) & mask;
-	while (size-- > 0) {
-		if (!env->keys[i] || string_equals(name, env->keys[i])) {
-			env->keys[i] = name;
-			memcpy(&env->values[i], value, sizeof(*value));
-			env->used++;
-			return true;
+				env->keys[i] = old_keys[j];
+				env->values[i] = old_values[j];
+			}
 		}
+	}
 
+	u32 mask = env->size - 1;
+	u32 i = symbol_hash(name) & mask;
+	while (env->keys[i] && env->keys[i] != name) {
 		i = (i + 1) & mask;
 	}
 
-	return false;
+	if (!env->keys[i]) {
+		env->keys[i] = name;
+		env->used++;
+	}
+
+	memcpy(&env->values[i], value, sizeof(*value));
+	symbol_touch(name);
+	env->version++;
+	return true;
 }
 
 static struct tex_value *
@@ -134,27 +403,29 @@ tex_builtin_unwrap(struct tex_value *value)
 	return is_1x1_matrix ? tex_builtin_unwrap(value->matrix.values) : value;
 }
 
-static usize
-tex_value_write(struct tex_value *value, struct qm_buffer *output)
+static void tex_concat_write(struct tex_value *value,
+	struct qm_output *output);
+
+static void
+tex_value_write(struct tex_value *value, struct qm_output *output)
 {
 	char number_str[64] = {0};
-	u32 total = 0;
 
 	switch (value->type) {
 	case TEX_VALUE_FUNCTION:
-		total += buffer_write(output, (u8 *)"<fn>");
+		output_literal(output, "<fn>");
 		break;
 	case TEX_VALUE_STRING:
-		total += buffer_write(output, (u8 *)"\\text{");
-		total += buffer_writen(output, value->string.data, value->string.size);
-		total += buffer_write(output, (u8 *)"}");
+		output_literal(output, "\\text{");
+		output_writen(output, value->string.data, value->string.size);
+		output_literal(output, "}");
 		break;
 	case TEX_VALUE_RAW_STRING:
-		total += buffer_writen(output, value->string.data, value->string.size);
+		output_writen(output, value->string.data, value->string.size);
 		break;
 	case TEX_VALUE_NUMBER:
-		snprintf(number_str, sizeof(number_str), "%d", value->number);
-		total += buffer_write(output, (u8 *)number_str);
+		output_writen(output, (u8 *)number_str, snprintf(number_str,
+			sizeof(number_str), "%d", value->number));
 		break;
 	case TEX_VALUE_MATRIX:
 		{
@@ -162,31 +433,38 @@ tex_value_write(struct tex_value *value, struct qm_buffer *output)
 			u32 delimiter = value->matrix.delimiter;
 			assert(delimiter < QM_TOKEN_COUNT);
 
-			const u8 *open_delim = open_delimiters[is_matrix][delimiter];
-			const u8 *closing_delim = closing_delimiters[is_matrix][delimiter];
-			total += buffer_write(output, open_delim);
+			struct qm_string open_delim = open_delimiters[is_matrix][delimiter];
+			struct qm_string closing_delim = closing_delimiters[is_matrix][delimiter];
+			output_write(output, open_delim);
 
 			u32 width = value->matrix.width;
 			u32 height = value->matrix.height;
-			const u8 *cell_delimiter = (u8 *)(height > 1 ? " & " : ", ");
+			struct qm_string cell_delimiter = QM_STRING(", ");
+			if (height > 1) {
+				cell_delimiter = (struct qm_string)QM_STRING(" & ");
+			}
+
 			struct tex_value *values = value->matrix.values;
 			for (u32 i = 0; i < height; i++) {
 				if (i != 0) {
-					total += buffer_write(output, (u8 *)"\\\n");
+					output_literal(output, "\\\n");
 				}
 
 				for (u32 j = 0; j < width; j++) {
 					if (j != 0 && height == 1) {
-						total += buffer_write(output, cell_delimiter);
+						output_write(output, cell_delimiter);
 					}
 
-					total += tex_value_write(values++, output);
+					tex_value_write(values++, output);
 				}
 			}
 
-			total += buffer_write(output, closing_delim);
+			output_write(output, closing_delim);
 		}
 		break;
+	case TEX_VALUE_CONCAT:
+		tex_concat_write(value, output);
+		break;
 	default:
 		fprintf(stderr, "value->type = %d\n", value->type);
 		fflush(stderr);
@@ -194,154 +472,64 @@ tex_value_write(struct tex_value *value, struct qm_buffer *output)
 		assert(!"Not implemented");
 	}
 
-	return total;
 }
 
-static bool tex_eval_expression(struct qm_expression *expression,
-	struct tex_value *value, struct qm_memory_arena *arena,
-	struct tex_environment *env);
-
-static bool
-tex_eval_call(struct qm_call *call, struct tex_value *value,
-		struct qm_memory_arena *arena, struct tex_environment *env)
+/*
+ * Juxtapositions are usually nested very deeply on the left, so the parts are
+ * written in order with an explicit stack of the right values.
+ */
+static void
+tex_concat_write(struct tex_value *value, struct qm_output *output)
 {
-	struct tex_value callee;
-	struct tex_value arg;
-
-	bool is_variable = call->callee->type == QM_EXPR_VARIABLE;
-	if (is_variable && string_equals(call->callee->variable, (u8 *)"__unwrap__")) {
-		assert(tex_eval_expression(call->arg, &arg, arena, env));
-
-		memcpy(value, tex_builtin_unwrap(&arg), sizeof(*value));
-	} else {
-		assert(tex_eval_expression(call->callee, &callee, arena, env));
-		assert(tex_eval_expression(call->arg, &arg, arena, env));
-
-		if (callee.type == TEX_VALUE_FUNCTION) {
-			u8 **parameters = callee.function.parameters;
-			u32 parameter_count = callee.function.parameter_count;
-
-			bool is_matrix = arg.type == TEX_VALUE_MATRIX;
-			u32 width = arg.matrix.width;
-			u32 height = arg.matrix.height;
-			assert(parameter_count == 1 || (is_matrix && width == parameter_count && height == 1));
+	struct tex_value *local_stack[64];
+	struct tex_value **stack = local_stack;
+	u32 capacity = 64;
+	u32 count = 0;
+
+	stack[count++] = value;
+	while (count > 0) {
+		value = stack[--count];
+		while (value->type == TEX_VALUE_CONCAT) {
+			if (count == capacity) {
+				struct tex_value **new_stack = malloc(2 * capacity * sizeof(*stack));
+				if (!new_stack) {
+					perror("malloc");
+					exit(EXIT_FAILURE);
+				}
 
-			struct tex_environment subenv = {0};
-			subenv.parent = env;
+				memcpy(new_stack, stack, count * sizeof(*stack));
+				if (stack != local_stack) {
+					free(stack);
+				}
 
-			struct tex_value *values = parameter_count != 1 ? arg.matrix.values : &arg;
-			for (u32 i = 0; i < parameter_count; i++) {
-				tex_env_define(&subenv, arena, *parameters++, values++);
+				stack = new_stack;
+				capacity *= 2;
 			}
 
-			struct qm_expression *expression = &callee.function.expression;
-			tex_eval_expression(expression, value, arena, &subenv);
-		} else {
-			struct qm_buffer buffer = {0};
-			buffer.size += tex_value_write(&callee, 0);
-			buffer.size += tex_value_write(&arg, 0);
-			buffer.data = arena_alloc(arena, buffer.size, u8);
-			tex_value_write(&callee, &buffer);
-			tex_value_write(&arg, &buffer);
-
-			value->type = TEX_VALUE_RAW_STRING;
-			value->string.data = buffer.data;
-			value->string.size = buffer.size;
+			stack[count++] = value->concat.right;
+			value = value->concat.left;
 		}
-	}
-
-	assert(0 <= value->type && value->type < TEX_VALUE_COUNT);
-	return true;
-}
-
-static bool
-tex_eval_expression(struct qm_expression *expression, struct tex_value *value,
-		struct qm_memory_arena *arena, struct tex_environment *env)
-{
-	switch (expression->type) {
-	case QM_EXPR_MATRIX:
-		{
-			struct qm_expression *expressions = expression->matrix.expressions;
-			u32 height = expression->matrix.height;
-			u32 width = expression->matrix.width;
 
-			struct tex_value *values = arena_alloc(arena, width * height,
-				struct tex_value);
-
-			value->type = TEX_VALUE_MATRIX;
-			value->matrix.width  = width;
-			value->matrix.height = height;
-			value->matrix.values = values;
-			value->matrix.delimiter = expression->matrix.delimiter;
-
-			for (u32 i = 0; i < height; i++) {
-				for (u32 j = 0; j < width; j++) {
-					tex_eval_expression(expressions++, values++, arena, env);
-				}
-			}
-		}
-		break;
-	case QM_EXPR_CALL:
-		assert(tex_eval_call(&expression->call, value, arena, env));
-		break;
-	case QM_EXPR_STRING:
-		value->type = TEX_VALUE_STRING;
-		// NOTE: should use a conversion function in the future for escaping
-		// special symbols.
-		value->string.data = expression->string + 1;
-		value->string.size = string_length(expression->string) - 2;
-		break;
-	case QM_EXPR_RAW_STRING:
-		value->type = TEX_VALUE_RAW_STRING;
-		// NOTE: should use a conversion function in the future for escaping
-		// special symbols.
-		value->string.data = expression->string + 1;
-		value->string.size = string_length(expression->string) - 2;
-		break;
-	case QM_EXPR_VARIABLE:
-		if (!tex_env_find(env, expression->variable, value)) {
-			value->type = TEX_VALUE_RAW_STRING;
-			value->string.data = expression->variable;
-			value->string.size = string_length(expression->variable);
-		}
-		break;
-	case QM_EXPR_NUMBER:
-		value->type = TEX_VALUE_NUMBER;
-		value->number = expression->number;
-		break;
+		tex_value_write(value, output);
 	}
 
-	assert(0 <= value->type && value->type < TEX_VALUE_COUNT);
-	return true;
+	if (stack != local_stack) {
+		free(stack);
+	}
 }
 
-static usize
-tex_eval(struct qm_statement *stmt, struct qm_buffer *output,
-		struct qm_memory_arena *arena, struct tex_environment *env)
+/* Replaces a concatenation with the string it renders to. */
+static void
+tex_value_flatten(struct tex_value *value, struct qm_memory_arena *arena)
 {
-	struct tex_value value;
-	usize size = 0;
+	if (value->type == TEX_VALUE_CONCAT) {
+		struct qm_output buffer = {0};
+		tex_value_write(value, &buffer);
 
-	switch (stmt->type) {
-	case QM_STMT_EXPRESSION:
-		if (tex_eval_expression(&stmt->expression, &value, arena, env)) {
-			size += tex_value_write(&value, output);
-		}
-		break;
-	case QM_STMT_DEFINITION:
-		if (stmt->definition.parameter_count != 0) {
-			value.type = TEX_VALUE_FUNCTION;
-			value.function.parameters = stmt->definition.parameters;
-			value.function.parameter_count = stmt->definition.parameter_count;
-			value.function.expression = stmt->definition.expression;
-		} else {
-			tex_eval_expression(&stmt->definition.expression,
-				&value, arena, env);
-		}
-
-		tex_env_define(env, arena, stmt->definition.variable, &value);
-		break;
+		value->type = TEX_VALUE_RAW_STRING;
+		value->string.data = arena_alloc(arena, buffer.used, u8);
+		value->string.size = buffer.used;
+		memcpy(value->string.data, buffer.data, buffer.used);
+		output_finish(&buffer);
 	}
-
-	return size;
 }
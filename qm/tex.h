@@ -5,14 +5,14 @@ enum tex_value_type {
 	TEX_VALUE_MATRIX,
 	TEX_VALUE_STRING,
 	TEX_VALUE_RAW_STRING,
+	TEX_VALUE_CONCAT,
 	TEX_VALUE_COUNT
 };
 
-struct tex_function {
-	u8 **parameters;
-	u32 parameter_count;
+struct tex_code;
 
-	struct qm_expression expression;
+struct tex_function {
+	struct tex_code *code;
 };
 
 struct tex_matrix {
@@ -27,6 +27,12 @@ struct tex_string {
 	u32 size;
 };
 
+/* NOTE: renders as the left value followed by the right value. */
+struct tex_concat {
+	struct tex_value *left;
+	struct tex_value *right;
+};
+
 struct tex_value {
 	enum tex_value_type type;
 
@@ -34,16 +40,156 @@ struct tex_value {
 		struct tex_matrix matrix;
 		struct tex_function function;
 		struct tex_string string;
+		struct tex_concat concat;
 		i32 number;
 	};
 };
 
 struct tex_environment {
-	u8 **keys;
+	u32 *keys;
 	struct tex_value *values;
 
 	u32 used;
 	u32 size;
+	/* NOTE: incremented by every definition. */
+	u32 version;
 
 	struct tex_environment *parent;
+#if QM_STATS
+	struct qm_probe_stats probes;
+#endif
+};
+
+enum tex_opcode {
+	TEX_OP_CONSTANT,
+	TEX_OP_LOCAL,
+	TEX_OP_NAME,
+	TEX_OP_MATRIX,
+	TEX_OP_CALL,
+	TEX_OP_UNWRAP,
+	TEX_OP_SLIDE,
+	TEX_OP_RETURN,
+	TEX_OP_COUNT
+};
+
+enum tex_purity {
+	TEX_PURITY_UNKNOWN,
+	TEX_PURITY_PENDING,
+	TEX_PURITY_PURE,
+	TEX_PURITY_IMPURE,
+};
+
+enum tex_kind {
+	TEX_KIND_UNKNOWN,
+	TEX_KIND_VALUE,
+	TEX_KIND_FUNCTION,
+};
+
+struct tex_assumption {
+	u32 symbol;
+	u32 version;
+};
+
+struct tex_code {
+	u32 *ops;
+	u32 op_count;
+	struct tex_value *constants;
+	u32 constant_count;
+
+	u32 *parameters;
+	u32 parameter_count;
+
+	/*
+	 * NOTE: only valid for the environment version it was computed for. A
+	 * leaf calls no other functions.
+	 */
+	u8 purity;
+	bool is_leaf;
+	u32 purity_version;
+
+	/*
+	 * NOTE: the optimized code is only valid as long as the symbols it was
+	 * specialized for keep their version, otherwise this code is used.
+	 */
+	struct tex_code *optimized;
+	struct tex_assumption *assumptions;
+	u32 assumption_count;
+	bool is_inlinable;
+};
+
+struct tex_memo_entry {
+	struct tex_code *code;
+	u32 hash;
+	struct tex_value arg;
+	struct tex_value result;
+};
+
+struct tex_memo {
+	struct qm_memory_arena arena;
+	struct tex_memo_entry *entries;
+	u32 used;
+	u32 size;
+	u32 version;
+
+	/* NOTE: the hashes of the calls which missed once, see tex_memo_insert. */
+	u32 *seen;
+
+	u64 hits;
+	u64 misses;
+};
+
+struct tex_frame {
+	struct tex_code *code;
+	u32 ip;
+	u32 base;
+
+	/* NOTE: the result is cached for this function and argument on return. */
+	struct tex_code *memo_code;
+	u32 hash;
+	struct tex_value arg;
+};
+
+struct tex_vm {
+	/* NOTE: calls are not cached if this is null. */
+	struct tex_memo *memo;
+
+	struct tex_value *stack;
+	u32 stack_size;
+	u32 stack_capacity;
+
+	struct tex_frame *frames;
+	u32 frame_count;
+	u32 frame_capacity;
+
+	/* NOTE: buffers of the compiler, reused for every definition. */
+	u32 *ops;
+	u32 op_count;
+	u32 op_capacity;
+	struct tex_value *constants;
+	u32 constant_count;
+	u32 constant_capacity;
+
+	/*
+	 * NOTE: state of the optimizer, which is only active if env is set. The
+	 * kinds track the values on the stack of the code being compiled.
+	 */
+	struct tex_environment *env;
+	u32 defining;
+	u32 local_count;
+	u32 depth;
+	u8 *kinds;
+	u32 kind_capacity;
+	u32 constant_end;
+	u32 concat_end;
+	bool is_inlinable;
+	struct tex_assumption *assumptions;
+	u32 assumption_count;
+	u32 assumption_capacity;
+
+	/* NOTE: set while subexpressions are evaluated at compile time. */
+	bool is_folding;
+	bool fold_failed;
+	u32 fold_budget;
+	/* NOTE: the reason why the evaluation of a statement failed. */
+	const char *error;
 };
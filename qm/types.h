@@ -1,7 +1,18 @@
 #define MAX(a, b) ((a) > (b)? (a) : (b))
+#define MIN(a, b) ((a) < (b)? (a) : (b))
 
+#define QM_STRING(literal) { (u8 *)(literal), sizeof(literal) - 1 }
+
+#define QM_ARENA_ALIGNMENT 8
+#define QM_ARENA_RESERVE_SIZE ((usize)1 << 35)
+#define QM_ARENA_COMMIT_SIZE ((usize)1 << 16)
+#define QM_HUGE_PAGE_SIZE ((usize)1 << 21)
+
+/* NOTE: the memory of arena_alloc is uninitialized. */
 #define arena_alloc(arena, count, type) \
 	((type *)arena_alloc_(arena, (count) * sizeof(type)))
+#define arena_alloc_zero(arena, count, type) \
+	((type *)arena_alloc_zero_(arena, (count) * sizeof(type)))
 
 typedef size_t usize;
 
@@ -28,6 +39,51 @@ struct qm_memory_block {
 
 struct qm_memory_arena {
 	struct qm_memory_block *block;
+	/* NOTE: blocks released by arena_end_temp, reused before new ones. */
+	struct qm_memory_block *free_blocks;
+
+	/*
+	 * NOTE: if base is set, the arena is a reserved range of address space
+	 * instead of blocks. The memory after the dirty offset was never used and
+	 * is still zero.
+	 */
+	u8 *base;
+	usize used;
+	usize dirty;
+	usize committed;
+	usize reserved;
+};
+
+#ifndef QM_STATS
+#define QM_STATS 1
+#endif
+
+enum qm_phase {
+	QM_PHASE_MACROS,
+	QM_PHASE_SCAN,
+	QM_PHASE_PARSE,
+	QM_PHASE_EVAL,
+	QM_PHASE_COUNT
+};
+
+#define QM_PROBE_BUCKETS 16
+
+/* NOTE: the last bucket also counts all longer probe sequences. */
+struct qm_probe_stats {
+	u64 lookups;
+	u64 histogram[QM_PROBE_BUCKETS];
+};
+
+struct qm_cache_stats {
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+};
+
+struct qm_arena_temp {
+	struct qm_memory_arena *arena;
+	struct qm_memory_block *block;
+	usize used;
 };
 
 enum qm_token_type {
@@ -53,15 +109,142 @@ enum qm_token_type {
 	QM_TOKEN_COUNT
 };
 
+/* NOTE: strings are slices into their source buffer, not NUL-terminated. */
+struct qm_string {
+	u8 *data;
+	u32 size;
+};
+
 struct qm_token {
 	i32 type;
 	u32 start;
+	u32 length;
+	u32 symbol;
 };
 
 struct qm_buffer {
 	u8 *data;
-	u32 size;
-	u32 start;
+	usize size;
+	usize start;
+	bool is_mapped;
+};
+
+/*
+ * Window over a file, which is read in chunks. The bytes before start were
+ * already consumed, the bytes between start and at were scanned but not
+ * written yet. The offset is the position of the window in the file.
+ */
+struct qm_stream {
+	FILE *file;
+	u8 *data;
+	usize size;
+	usize capacity;
+	usize start;
+	usize at;
+	u64 offset;
+	bool is_eof;
+};
+
+enum qm_json_flags {
+	QM_JSON_OBJECT          = 1 << 0,
+	QM_JSON_EXPECT_KEY      = 1 << 1,
+	QM_JSON_KEY_T           = 1 << 2,
+	QM_JSON_KEY_C           = 1 << 3,
+	QM_JSON_IS_MATH         = 1 << 4,
+	QM_JSON_IS_MATH_TYPE    = 1 << 5,
+	QM_JSON_HAS_CONTENT     = 1 << 6,
+	QM_JSON_IS_CONTENT      = 1 << 7,
+	QM_JSON_HAS_MATH_TYPE   = 1 << 8,
+	QM_JSON_HAS_MATH_STRING = 1 << 9,
+};
+
+/* Object or array on the stack of the JSON scanner. */
+struct qm_json_frame {
+	u32 flags;
+	u32 index;
+};
+
+/*
+ * Scanner for the math nodes in a pandoc document. The indexes are the
+ * file offsets of the structural characters, which were found in the
+ * input but not processed yet.
+ */
+struct qm_json_scanner {
+	struct qm_stream input;
+
+	u64 *indexes;
+	u32 index_count;
+	u32 index_capacity;
+	u32 index_at;
+	u64 scanned;
+	u64 escape_carry;
+	u64 string_carry;
+
+	struct qm_json_frame *frames;
+	u32 depth;
+	u32 frame_capacity;
+
+	/* NOTE: the math string is held back until its node is closed. */
+	bool has_math;
+	u32 math_frame;
+	u64 math_start;
+	u64 math_end;
+};
+
+#define QM_OUTPUT_SLICES 64
+#define QM_OUTPUT_SLICE_MIN 1024
+
+/* Bytes outside of the buffer, which are written after offset bytes of it. */
+struct qm_output_slice {
+	const u8 *data;
+	usize size;
+	usize offset;
+};
+
+enum qm_flush_policy {
+	QM_FLUSH_BUFFER,
+	QM_FLUSH_BLOCK,
+};
+
+struct qm_output {
+	u8 *data;
+	usize size;
+	usize used;
+	struct qm_output_slice *slices;
+	u32 slice_count;
+
+	/* NOTE: memory outputs grow instead of being flushed to a file. */
+	FILE *file;
+	bool escape_json;
+};
+
+/* NOTE: a document of the batch, which is rendered to its own file. */
+struct qm_document {
+	char *input_path;
+	char *output_path;
+};
+
+struct qm_options {
+	char *macro_path;
+	char *input_path;
+	char *socket_path;
+	char *image_path;
+	char *render_cache_path;
+	u64 render_cache_size;
+	struct qm_buffer manifest;
+	struct qm_document *documents;
+	u32 document_count;
+	u32 document_capacity;
+	enum qm_flush_policy flush;
+	u32 jobs;
+	bool memo;
+	bool memo_stats;
+	bool huge_pages;
+	bool stats;
+	bool stats_json;
+	bool server;
+	bool compile;
+	bool batch;
 };
 
 enum qm_result {
@@ -69,13 +252,67 @@ enum qm_result {
 	QM_ERR_INVALID_TOKEN,
 };
 
+enum qm_builtin_symbol {
+	QM_SYMBOL_NONE,
+	QM_SYMBOL_UNWRAP,
+	QM_SYMBOL_EQUALS,
+	QM_SYMBOL_COUNT
+};
+
+enum qm_symbol_flags {
+	QM_SYMBOL_PARAMETER = 1 << 0,
+};
+
+struct qm_symbol {
+	u8 *name;
+	u32 length;
+	u32 hash;
+	u32 flags;
+	/* NOTE: incremented whenever the meaning of the name can change. */
+	u32 version;
+};
+
+struct qm_symbol_table {
+	struct qm_memory_arena arena;
+	struct qm_symbol *symbols;
+	u32 count;
+	u32 capacity;
+
+	u32 *slots;
+	u32 slot_count;
+};
+
+/* NOTE: the symbols before a document, see symbols_save. */
+struct qm_symbol_snapshot {
+	struct qm_symbol *symbols;
+	u32 count;
+	struct qm_arena_temp temp;
+};
+
+enum qm_fixity {
+	QM_FIXITY_PREFIX  = 1 << 0,
+	QM_FIXITY_INFIX   = 1 << 1,
+	QM_FIXITY_POSTFIX = 1 << 2,
+};
+
+struct qm_operator {
+	u32 fixity;
+	i32 prefix_rbp;
+	i32 infix_lbp;
+	i32 infix_rbp;
+	i32 postfix_lbp;
+};
+
 struct qm_operator_table {
-	u8 **keys;
-	i32 *lbp;
-	i32 *rbp;
+	u32 *keys;
+	u32 *hashes;
+	struct qm_operator *values;
 
 	u32 used;
 	u32 size;
+#if QM_STATS
+	struct qm_probe_stats probes;
+#endif
 };
 
 struct qm_parser {
@@ -83,7 +320,24 @@ struct qm_parser {
 	struct qm_token token;
 	struct qm_operator_table operators;
 
-	bool is_initialized;
+	struct qm_token *tokens;
+	u32 token_count;
+	u32 token_capacity;
+	u32 token_index;
+
+	/* NOTE: the line index is only built once an error is reported. */
+	u32 *lines;
+	u32 line_count;
+	u32 line_capacity;
+
+	/* NOTE: unfinished matrix cells, see parse_matrix. */
+	struct qm_expression *scratch;
+	u32 scratch_used;
+	u32 scratch_capacity;
+
+	const char *name;
+	u32 error_count;
+	u32 error_token;
 	i32 result;
     i32 bp;
 };
@@ -120,15 +374,15 @@ struct qm_expression {
 	union {
 		struct qm_matrix matrix;
 		struct qm_call call;
-		u8 *variable;
-		u8 *string;
+		u32 variable;
+		struct qm_string string;
 		i32 number;
 	};
 };
 
 struct qm_definition {
-	u8 *variable;
-	u8 **parameters;
+	u32 variable;
+	u32 *parameters;
 	u32 parameter_count;
 	struct qm_expression expression;
 };
@@ -142,6 +396,8 @@ enum qm_statement_type {
 
 struct qm_statement {
 	i32 type;
+	/* NOTE: the offset of the first token in the source, for errors. */
+	u32 offset;
 
 	union {
 		struct qm_expression expression;